@@ -0,0 +1,189 @@
+#include "batch.h"
+#include "convert.h"
+#include "dump.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Conversion of many picture dumps on a pool of worker threads. */
+
+
+
+typedef struct batch_s {
+  char **files;
+  int count;
+  int next;   /* Index of next file to be picked by a worker. */
+  int failed;
+  const convert_options_t *options;
+  pthread_mutex_t lock;
+} batch_t;
+
+
+
+static void add_file(batch_t *batch, const char *name)
+{
+  batch->files = realloc(batch->files, sizeof(char *) * (batch->count + 1));
+  if (batch->files == NULL)
+    error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+
+  batch->files[batch->count] = strdup(name);
+  if (batch->files[batch->count] == NULL)
+    error(1, 0, "%s.%d: strdup() failed.", __FILE__, __LINE__);
+  batch->count++;
+}
+
+
+
+static int is_dump(const struct dirent *entry)
+{
+  size_t len = strlen(entry->d_name);
+  return (len > 4 && strcmp(entry->d_name + len - 4, ".dat") == 0);
+}
+
+
+
+/* Directories are expanded to the picture dumps (*.dat) they contain. */
+static void add_path(batch_t *batch, const char *path)
+{
+  int i, n;
+  struct stat st;
+  struct dirent **entries;
+  char name[PATH_MAX];
+
+  if (stat(path, &st) == -1) {
+    error(0, errno, "%s.%d: stat(): %s", __FILE__, __LINE__, path);
+    batch->failed++;
+    return;
+  }
+
+  if (! S_ISDIR(st.st_mode)) {
+    add_file(batch, path);
+    return;
+  }
+
+  n = scandir(path, &entries, is_dump, alphasort);
+  if (n == -1) {
+    error(0, errno, "%s.%d: scandir(): %s", __FILE__, __LINE__, path);
+    batch->failed++;
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%s/%s", path, entries[i]->d_name);
+    add_file(batch, name);
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+
+
+static int convert_file(batch_t *batch, const char *name)
+{
+  int result;
+  dump_t dump;
+  char base[PATH_MAX];
+  stats_t stats;
+
+  if (dump_map(name, &dump) == -1)
+    return -1;
+
+  dump_base_name(name, base, sizeof(base));
+  stats_init(&stats);
+  result = convert_picture(dump.data, dump.size, batch->options, base,
+    (stats_enabled()) ? &stats : NULL);
+  if (result == 0)
+    stats_report(&stats, base);
+
+  dump_unmap(&dump);
+  return result;
+}
+
+
+
+static void *batch_worker(void *arg)
+{
+  batch_t *batch = arg;
+  int i;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    i = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (i >= batch->count)
+      break;
+
+    if (convert_file(batch, batch->files[i]) == -1) {
+      error(0, 0, "%s.%d: Conversion failed: %s",
+        __FILE__, __LINE__, batch->files[i]);
+      pthread_mutex_lock(&batch->lock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+
+  return NULL;
+}
+
+
+
+/* Convert files (and directories of files) using a number of threads, or
+   one for each online CPU if threads is 0. Returns the number of failures. */
+int batch_convert(char *paths[], int count, int threads,
+  const convert_options_t *options)
+{
+  int i, result, unusable;
+  pthread_t *workers;
+  batch_t batch;
+
+  batch.files = NULL;
+  batch.count = 0;
+  batch.next = 0;
+  batch.failed = 0;
+  batch.options = options;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  for (i = 0; i < count; i++)
+    add_path(&batch, paths[i]);
+  unusable = batch.failed;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > batch.count)
+    threads = batch.count;
+  if (threads < 1)
+    threads = 1;
+
+  workers = malloc(sizeof(pthread_t) * threads);
+  if (workers == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  for (i = 0; i < threads; i++) {
+    result = pthread_create(&workers[i], NULL, batch_worker, &batch);
+    if (result != 0)
+      error(1, result, "%s.%d: pthread_create()", __FILE__, __LINE__);
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+
+  printf("Converted %d of %d files using %d threads.\n",
+    batch.count - (batch.failed - unusable),
+    batch.count, threads);
+
+  for (i = 0; i < batch.count; i++)
+    free(batch.files[i]);
+  free(batch.files);
+  free(workers);
+  pthread_mutex_destroy(&batch.lock);
+
+  return batch.failed;
+}
@@ -0,0 +1,9 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "convert.h"
+
+int batch_convert(char *paths[], int count, int threads,
+  const convert_options_t *options);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,419 @@
+#include "jpeg.h"
+#include "pnm.h"
+#include "filter.h"
+#include "idct.h"
+#include "simd.h"
+#include "dump.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Decoder benchmarks. Each benchmark is run once for warmup, then timed
+   for a number of repetitions of at least a minimum time each, and the
+   median is reported. */
+
+
+
+typedef void (*bench_func_t)(void *arg);
+
+static int repetitions = 5;
+static long min_time = 200; /* For each repetition, in ms. */
+
+/* Picture dumps to decode, with the 6 byte header skipped. */
+static dump_t *corpus;
+static int corpus_count;
+static long corpus_blocks;
+static long corpus_bytes;
+
+/* Coefficient blocks for the IDCT benchmarks. */
+#define BENCH_BLOCKS 256
+static int sample_full[BENCH_BLOCKS][64];
+static int sample_4x4[BENCH_BLOCKS][64];
+static int sample_dc[BENCH_BLOCKS][64];
+
+/* A row of pixels for the color conversion benchmark. */
+static int sample_y[320], sample_cb[320], sample_cr[320];
+
+
+
+static void display_help(void)
+{
+  fprintf(stderr, "\nUsage: polaroid-bench [OPTIONS] FILE...\n"
+    "\nOptions:\n"
+    "  -h          Display this help and exit.\n"
+    "  -r REPS     Timed repetitions of each benchmark (default %d).\n"
+    "  -t MS       Minimum time of each repetition (default %ld).\n"
+    "  -s KERNELS  SIMD kernels: auto (default), none, sse2 or avx2.\n\n"
+    "FILE is a picture dump (from polaroid -n) used for the decode\n"
+    "benchmarks, which are skipped without any.\n\n",
+    repetitions, min_time);
+}
+
+
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+
+/* Each call of func handles units units, and bytes bytes of input. */
+static void bench(const char *name, const char *unit, bench_func_t func,
+  void *arg, long units, long bytes)
+{
+  int r;
+  long i, calls;
+  double start, elapsed, seconds[64];
+
+  /* Warmup, also finding the number of calls for the minimum time. */
+  calls = 1;
+  while (1) {
+    start = now();
+    for (i = 0; i < calls; i++)
+      func(arg);
+    elapsed = now() - start;
+    if (elapsed * 1000 >= min_time / 4)
+      break;
+    calls *= 2;
+  }
+  calls = calls * (min_time / 1000.0) / elapsed + 1;
+
+  for (r = 0; r < repetitions; r++) {
+    start = now();
+    for (i = 0; i < calls; i++)
+      func(arg);
+    seconds[r] = (now() - start) / calls;
+  }
+  qsort(seconds, repetitions, sizeof(double), compare_double);
+  elapsed = seconds[repetitions / 2];
+
+  printf("%-24s %10.1f ns/%-6s %12.0f %s/s", name,
+    elapsed * 1e9 / units, unit, units / elapsed, unit);
+  if (bytes > 0)
+    printf(" %8.2f MB/s", bytes / elapsed / 1e6);
+  printf("\n");
+}
+
+
+
+static void count_block(void *sink, int coef[], int block_no)
+{
+  (*(long *)sink)++;
+}
+
+
+
+static void ignore_block(void *sink, int block[], int block_no)
+{
+}
+
+
+
+static void bench_entropy(void *arg)
+{
+  int i;
+  jpeg_t *jpeg = arg;
+
+  for (i = 0; i < corpus_count; i++)
+    jpeg_decode_coefficients(jpeg, corpus[i].data, corpus[i].size,
+      ignore_block, NULL);
+}
+
+
+
+static void bench_decode(void *arg)
+{
+  int i;
+  jpeg_t *jpeg = arg;
+
+  for (i = 0; i < corpus_count; i++)
+    jpeg_decode(jpeg, corpus[i].data, corpus[i].size, ignore_block, NULL);
+}
+
+
+
+/* Same steps as color conversion of each picture, without the file. */
+static void bench_end_to_end(void *arg)
+{
+  int i;
+  FILE *fh = arg;
+  jpeg_t jpeg;
+  pnm_t pnm;
+
+  for (i = 0; i < corpus_count; i++) {
+    pnm_init(&pnm, fh, 0, 1, 1, 0);
+    jpeg_init(&jpeg, 4, 2, 2, IDCT_FAST);
+    jpeg_decode(&jpeg, corpus[i].data, corpus[i].size, pnm_block_to_ppm,
+      &pnm);
+    jpeg_free(&jpeg);
+    pnm_finish(&pnm);
+  }
+}
+
+
+
+typedef struct idct_bench_s {
+  const char *name;
+  void (**idct)(int block[]); /* Pointer, to allow the SIMD dispatch. */
+  int (*samples)[64];
+} idct_bench_t;
+
+static void (*idct_fast_function)(int block[]) = idct_fast;
+static void (*idct_fast_4x4_function)(int block[]) = idct_fast_4x4;
+static void (*idct_fast_dc_function)(int block[]) = idct_fast_dc;
+static void (*idct_float_function)(int block[]) = idct_float;
+static void (*idct_reference_function)(int block[]) = idct_reference;
+static void (*idct_scaled_4x4_function)(int block[]) = idct_scaled_4x4;
+
+static idct_bench_t idct_benches[] = {
+  {"idct fast", &idct_fast_function, sample_full},
+  {"idct fast (simd)", &simd_idct, sample_full},
+  {"idct fast 4x4", &idct_fast_4x4_function, sample_4x4},
+  {"idct fast dc", &idct_fast_dc_function, sample_dc},
+  {"idct float", &idct_float_function, sample_full},
+  {"idct reference", &idct_reference_function, sample_full},
+  {"idct scaled 4x4", &idct_scaled_4x4_function, sample_4x4},
+};
+
+
+
+/* The copy of each block is included in the time, as the IDCT is done in
+   place. */
+static void bench_idct(void *arg)
+{
+  int i;
+  int block[64];
+  idct_bench_t *idct_bench = arg;
+
+  for (i = 0; i < BENCH_BLOCKS; i++) {
+    memcpy(block, idct_bench->samples[i], sizeof(block));
+    (*idct_bench->idct)(block);
+  }
+}
+
+
+
+static void bench_ycc_to_rgb(void *arg)
+{
+  unsigned char rgb[320 * 3];
+
+  simd_ycc_to_rgb(sample_y, sample_cb, sample_cr, rgb, 320);
+}
+
+
+
+/* A whole picture of flat blocks, through the PPM converter. */
+static void bench_ppm(void *arg)
+{
+  int i;
+  int block[64];
+  FILE *fh = arg;
+  pnm_t pnm;
+
+  for (i = 0; i < 64; i++)
+    block[i] = (i * 4) % 256;
+
+  pnm_init(&pnm, fh, 0, 1, 1, 0);
+  for (i = 0; i < 15 * 20 * 4; i++)
+    pnm_block_to_ppm(&pnm, block, i);
+  pnm_finish(&pnm);
+}
+
+
+
+static void ignore_row(void *sink, const unsigned char *row)
+{
+}
+
+
+
+/* Despeckle and sharpen of a whole color picture. */
+static void bench_filter(void *arg)
+{
+  int i;
+  unsigned char row[320 * 3];
+  filter_t filter;
+
+  for (i = 0; i < sizeof(row); i++)
+    row[i] = (i * 7) % 256;
+
+  filter_init(&filter, sizeof(row), 3, 20, 80);
+  for (i = 0; i < 240; i++) {
+    row[i] = 255 - row[i];
+    filter_push(&filter, row, ignore_row, NULL);
+  }
+  filter_finish(&filter, ignore_row, NULL);
+  filter_free(&filter);
+}
+
+
+
+/* Coefficients like those in real blocks, with smaller values for higher
+   frequencies, and a row of varied colors. */
+static void make_samples(void)
+{
+  int i, j, row, col;
+  unsigned int seed = 1;
+
+  memset(sample_4x4, 0, sizeof(sample_4x4));
+  memset(sample_dc, 0, sizeof(sample_dc));
+
+  for (i = 0; i < BENCH_BLOCKS; i++) {
+    for (j = 0; j < 64; j++) {
+      row = j / 8;
+      col = j % 8;
+      seed = seed * 1103515245 + 12345;
+      sample_full[i][j] = (int)((seed >> 16) % 512 - 256) / (1 + row + col);
+      if (row < 4 && col < 4)
+        sample_4x4[i][j] = sample_full[i][j];
+    }
+    sample_dc[i][0] = sample_full[i][0];
+  }
+
+  for (i = 0; i < 320; i++) {
+    sample_y[i] = i % 256;
+    sample_cb[i] = (i * 3) % 256;
+    sample_cr[i] = (i * 7) % 256;
+  }
+}
+
+
+
+static void load_corpus(char *names[], int count)
+{
+  int i;
+  long blocks;
+  jpeg_t jpeg;
+
+  corpus = malloc(sizeof(dump_t) * count);
+  if (corpus == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  jpeg_init(&jpeg, 1, 1, 1, IDCT_FAST);
+  for (i = 0; i < count; i++) {
+    if (dump_map(names[i], &corpus[corpus_count]) == -1)
+      exit(1);
+    if (corpus[corpus_count].size < 6) {
+      error(0, 0, "%s.%d: Picture data too small, skipped: %s",
+        __FILE__, __LINE__, names[i]);
+      dump_unmap(&corpus[corpus_count]);
+      continue;
+    }
+
+    /* Note: Skip 6 first bytes, the fake header. */
+    corpus[corpus_count].data += 6;
+    corpus[corpus_count].size -= 6;
+    blocks = 0;
+    if (jpeg_decode_coefficients(&jpeg, corpus[corpus_count].data,
+      corpus[corpus_count].size, count_block, &blocks) == -1) {
+      error(0, 0, "%s.%d: Invalid picture data, skipped: %s",
+        __FILE__, __LINE__, names[i]);
+      corpus[corpus_count].data -= 6;
+      corpus[corpus_count].size += 6;
+      dump_unmap(&corpus[corpus_count]);
+      continue;
+    }
+    corpus_blocks += blocks;
+    corpus_bytes += corpus[corpus_count].size;
+    corpus_count++;
+  }
+  jpeg_free(&jpeg);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int i, c;
+  simd_t simd = SIMD_AUTO;
+  FILE *null;
+  jpeg_t jpeg;
+
+  while ((c = getopt(argc, argv, "hr:t:s:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help();
+      return 0;
+
+    case 'r':
+      repetitions = atoi(optarg);
+      if (repetitions < 1 || repetitions > 64)
+        error(1, 0, "%s.%d: Repetitions must be 1 to 64: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 't':
+      min_time = atol(optarg);
+      if (min_time < 1)
+        error(1, 0, "%s.%d: Invalid time: %s", __FILE__, __LINE__, optarg);
+      break;
+
+    case 's':
+      if (simd_parse(optarg, &simd) == -1)
+        error(1, 0, "%s.%d: Unknown SIMD kernels: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case '?':
+    default:
+      display_help();
+      return 1;
+    }
+  }
+
+  simd_init(simd);
+  make_samples();
+  load_corpus(&argv[optind], argc - optind);
+
+  null = fopen("/dev/null", "w");
+  if (null == NULL)
+    error(1, errno, "%s.%d: fopen(): /dev/null", __FILE__, __LINE__);
+
+  printf("SIMD kernels: %s, %d repetitions of at least %ld ms.\n",
+    simd_name(), repetitions, min_time);
+
+  for (i = 0; i < sizeof(idct_benches) / sizeof(idct_bench_t); i++)
+    bench(idct_benches[i].name, "block", bench_idct, &idct_benches[i],
+      BENCH_BLOCKS, 0);
+  bench("ycc to rgb", "pixel", bench_ycc_to_rgb, NULL, 320, 0);
+  bench("ppm output", "block", bench_ppm, null, 15 * 20 * 4, 0);
+  bench("despeckle and sharpen", "pixel", bench_filter, NULL, 320 * 240, 0);
+
+  if (corpus_count == 0) {
+    printf("No picture dumps given, decode benchmarks skipped.\n");
+  } else {
+    printf("Corpus: %d pictures, %ld blocks, %ld bytes.\n", corpus_count,
+      corpus_blocks, corpus_bytes);
+
+    /* Huffman decoding, receive() and extend(), with coefficients stored
+       in zig-zag order. */
+    jpeg_init(&jpeg, 4, 2, 2, IDCT_FAST);
+    bench("entropy decode", "block", bench_entropy, &jpeg, corpus_blocks,
+      corpus_bytes);
+    bench("decode", "block", bench_decode, &jpeg, corpus_blocks,
+      corpus_bytes);
+    jpeg_free(&jpeg);
+
+    bench("end to end (color)", "block", bench_end_to_end, null,
+      corpus_blocks, corpus_bytes);
+  }
+
+  fclose(null);
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* Cache directory for downloaded picture data. Each picture is stored in a
+   file named after its content hash, and listed in a manifest with one
+   line per picture: "picture_no size hash camera". */
+
+
+
+/* 64 bit FNV-1a hash. */
+static uint64_t hash_data(const unsigned char *data, size_t size)
+{
+  size_t i;
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
+}
+
+
+
+static void add_entry(cache_t *cache, int picture_no, size_t size,
+  uint64_t hash, const char *camera)
+{
+  cache_entry_t *entry;
+
+  cache->entries = realloc(cache->entries,
+    sizeof(cache_entry_t) * (cache->count + 1));
+  if (cache->entries == NULL)
+    error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+
+  entry = &cache->entries[cache->count];
+  entry->picture_no = picture_no;
+  entry->size = size;
+  entry->hash = hash;
+  entry->camera = strdup(camera);
+  if (entry->camera == NULL)
+    error(1, 0, "%s.%d: strdup() failed.", __FILE__, __LINE__);
+  cache->count++;
+}
+
+
+
+/* Open (and create if needed) the cache directory, and read the manifest.
+   Returns 0 on success, or -1 on error. */
+int cache_open(cache_t *cache, const char *directory, const char *camera)
+{
+  char name[PATH_MAX], line[256], entry_camera[256];
+  int picture_no;
+  size_t size;
+  uint64_t hash;
+  FILE *fh;
+
+  cache->entries = NULL;
+  cache->count = 0;
+
+  if (mkdir(directory, 0777) == -1 && errno != EEXIST) {
+    error(0, errno, "%s.%d: mkdir(): %s", __FILE__, __LINE__, directory);
+    return -1;
+  }
+
+  cache->directory = strdup(directory);
+  cache->camera = strdup(camera);
+  if (cache->directory == NULL || cache->camera == NULL)
+    error(1, 0, "%s.%d: strdup() failed.", __FILE__, __LINE__);
+
+  snprintf(name, sizeof(name), "%s/manifest", directory);
+  fh = fopen(name, "r");
+  if (fh == NULL) {
+    if (errno == ENOENT)
+      return 0; /* New cache. */
+    error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    /* Note: Broken lines, like one cut short by a crash, are ignored. */
+    if (sscanf(line, "%d %zu %" SCNx64 " %255[^\n]",
+      &picture_no, &size, &hash, entry_camera) == 4)
+      add_entry(cache, picture_no, size, hash, entry_camera);
+  }
+  fclose(fh);
+
+  return 0;
+}
+
+
+
+/* Returns a malloc()'ed copy of the picture data, or NULL if the picture is
+   not in the cache or the cached data is not valid. */
+unsigned char *cache_lookup(cache_t *cache, int picture_no, size_t size)
+{
+  int i;
+  char name[PATH_MAX];
+  unsigned char *data;
+  cache_entry_t *entry;
+  FILE *fh;
+
+  /* Note: Search backwards, the most recent entry is the valid one. */
+  for (i = cache->count - 1; i >= 0; i--) {
+    entry = &cache->entries[i];
+    if (entry->picture_no == picture_no && entry->size == size &&
+      strcmp(entry->camera, cache->camera) == 0)
+      break;
+  }
+  if (i < 0)
+    return NULL;
+
+  snprintf(name, sizeof(name), "%s/%016" PRIx64 ".dat", cache->directory,
+    entry->hash);
+  fh = fopen(name, "r");
+  if (fh == NULL)
+    return NULL;
+
+  data = malloc(size + 1);
+  if (data == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  /* Also reading one more byte, to make sure the file is not too long. */
+  if (fread(data, sizeof(unsigned char), size + 1, fh) != size ||
+    hash_data(data, size) != entry->hash) {
+    error(0, 0, "%s.%d: Invalid cached data: %s", __FILE__, __LINE__, name);
+    free(data);
+    data = NULL;
+  }
+  fclose(fh);
+
+  return data;
+}
+
+
+
+/* Failing to store data in the cache is not fatal, the picture will just
+   have to be downloaded again next time. */
+void cache_store(cache_t *cache, int picture_no, const unsigned char *data,
+  size_t size)
+{
+  char name[PATH_MAX], temp_name[PATH_MAX + 4]; /* Room for ".tmp". */
+  uint64_t hash;
+  FILE *fh;
+
+  hash = hash_data(data, size);
+
+  /* Note: Written to a temporary file first, so an interrupted write never
+     leaves a partial file with a valid name. */
+  if (snprintf(name, sizeof(name), "%s/%016" PRIx64 ".dat",
+    cache->directory, hash) >= sizeof(name)) {
+    error(0, 0, "%s.%d: Cache directory name too long: %s",
+      __FILE__, __LINE__, cache->directory);
+    return;
+  }
+  snprintf(temp_name, sizeof(temp_name), "%s.tmp", name);
+  fh = fopen(temp_name, "w");
+  if (fh == NULL) {
+    error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, temp_name);
+    return;
+  }
+  fwrite(data, sizeof(unsigned char), size, fh);
+  if (fclose(fh) == EOF) {
+    error(0, errno, "%s.%d: fclose(): %s", __FILE__, __LINE__, temp_name);
+    remove(temp_name);
+    return;
+  }
+  if (rename(temp_name, name) == -1) {
+    error(0, errno, "%s.%d: rename(): %s", __FILE__, __LINE__, name);
+    remove(temp_name);
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s/manifest", cache->directory);
+  fh = fopen(name, "a");
+  if (fh == NULL) {
+    error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+    return;
+  }
+  fprintf(fh, "%d %zu %016" PRIx64 " %s\n", picture_no, size, hash,
+    cache->camera);
+  if (fclose(fh) == EOF)
+    error(0, errno, "%s.%d: fclose(): %s", __FILE__, __LINE__, name);
+
+  add_entry(cache, picture_no, size, hash, cache->camera);
+}
+
+
+
+void cache_close(cache_t *cache)
+{
+  int i;
+
+  for (i = 0; i < cache->count; i++)
+    free(cache->entries[i].camera);
+  free(cache->entries);
+  free(cache->directory);
+  free(cache->camera);
+}
@@ -0,0 +1,29 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h> /* size_t */
+
+typedef struct cache_entry_s {
+  int picture_no;
+  size_t size;
+  uint64_t hash;
+  char *camera;
+} cache_entry_t;
+
+/* Downloaded picture data, kept between sessions. */
+typedef struct cache_s {
+  char *directory;
+  char *camera; /* Camera information, picture data is only reused for the
+                   same camera. */
+  cache_entry_t *entries;
+  int count;
+} cache_t;
+
+int cache_open(cache_t *cache, const char *directory, const char *camera);
+unsigned char *cache_lookup(cache_t *cache, int picture_no, size_t size);
+void cache_store(cache_t *cache, int picture_no, const unsigned char *data,
+  size_t size);
+void cache_close(cache_t *cache);
+
+#endif /* _CACHE_H */
@@ -1,8 +1,48 @@
+#include "comm.h"
+#include "stats.h" /* stats_clock() */
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <error.h>
 #include <unistd.h>
+#include <poll.h>
+
+/* Note: Reads are driven by poll(), so data is picked up as soon as it
+   arrives instead of after fixed sleeps. VMIN/VTIME are not used, since
+   VTIME only has a resolution of 1/10 second. */
+
+/* Silence after the last byte that ends a command response of unknown
+   length, in ms. USB serial adapters can hold back data for their latency
+   timer (16 ms for FTDI), so a response may arrive in bursts that far
+   apart. */
+#define COMM_RESPONSE_GAP 50
+
+/* Silence that shows an aborted transfer has ended, in ms. */
+#define COMM_DRAIN_GAP 200
+
+/* Waits for picture data longer than this are counted as stalls, in ms.
+   Frames arrive in a steady flow of small reads, even at low speeds. */
+#define COMM_STALL_GAP 100
+
+/* Time between redraws of the progress bar, in ms. */
+#define COMM_PROGRESS_INTERVAL 100
+
+#define COMM_FRAME_SIZE 2000
+
+static int comm_timeout = COMM_DEFAULT_TIMEOUT;
+static int comm_verify = 1;
+static int comm_telemetry_fd = -1;
+static comm_stats_t comm_stats;
+
+/* State of the picture data transfer in progress. */
+typedef struct transfer_s {
+  int picture_no;
+  long size;
+  long received;        /* Data received, not counting skipped frames. */
+  int64_t start;        /* Time the picture was first requested. */
+  int64_t progress;     /* Time the progress bar was last drawn. */
+  int progress_shown;   /* The progress bar line has not been ended. */
+} transfer_t;
 
 
 
@@ -17,11 +57,115 @@ static void dump_hex(char *buffer, size_t buffer_size)
 
 
 
+/* Time to wait for the camera, before giving up, in ms. */
+void comm_set_timeout(int timeout)
+{
+  comm_timeout = timeout;
+}
+
+
+
+/* Verify checksums of picture data frames, enabled by default. */
+void comm_set_verify(int verify)
+{
+  comm_verify = verify;
+}
+
+
+
+/* Write transfer telemetry to the file descriptor fd, as one line of JSON
+   for each frame and picture. Disabled by default, or when fd is -1. */
+void comm_set_telemetry(int fd)
+{
+  comm_telemetry_fd = fd;
+}
+
+
+
+/* Statistics for all picture data transferred so far. */
+void comm_get_stats(comm_stats_t *stats)
+{
+  *stats = comm_stats;
+}
+
+
+
+/* Wait up to timeout ms for data, and read what is available up to size.
+   The time spent waiting and reading is added to the statistics if timed
+   is set. Returns the number of bytes read, or 0 on timeout. */
+static size_t read_poll(int tty, void *buffer, size_t size, int timeout,
+  int timed)
+{
+  struct pollfd pfd;
+  ssize_t data_read;
+  int64_t start = 0, now, wait;
+  int result;
+
+  pfd.fd = tty;
+  pfd.events = POLLIN;
+
+  while (1) {
+    if (timed)
+      start = stats_clock();
+    result = poll(&pfd, 1, timeout);
+    if (timed) {
+      now = stats_clock();
+      wait = now - start;
+      comm_stats.wait_ns += wait;
+      if (wait > (int64_t)COMM_STALL_GAP * 1000000)
+        comm_stats.stalls++;
+      start = now;
+    }
+
+    switch (result) {
+    case -1:
+      if (errno == EINTR)
+        continue;
+      error(1, errno, "%s.%d: poll()", __FILE__, __LINE__);
+      break;
+
+    case 0:
+      return 0;
+    }
+
+    data_read = read(tty, buffer, size);
+    if (timed)
+      comm_stats.read_ns += stats_clock() - start;
+    if (data_read == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+    }
+    return data_read;
+  }
+}
+
+
+
+/* Read exactly size bytes, or exit if the camera stops sending. */
+static void read_exact(int tty, void *buffer, size_t size, int timed)
+{
+  size_t data_read;
+
+  while (size > 0) {
+    data_read = read_poll(tty, buffer, size, comm_timeout, timed);
+    if (data_read == 0)
+      error(1, 0, "%s.%d: Camera not responding.", __FILE__, __LINE__);
+    buffer = (char *)buffer + data_read;
+    size -= data_read;
+  }
+}
+
+
+
+/* Send a command, and pass the response to the callback. If size is not
+   0, the response is read until it is that long, otherwise until the line
+   is quiet for COMM_RESPONSE_GAP ms. */
 int comm_command(int tty, unsigned char command, unsigned char argument,
-  int (*response_callback)(char *, size_t))
+  size_t size, int (*response_callback)(char *, size_t))
 {
   char cmd[16], response[64];
-  int cmd_size, response_size, read_timeout = 0;
+  int cmd_size, response_size, data_read;
 
   if (argument > 0) {
     snprintf(cmd, sizeof(cmd), "\xE6\xE6\xE6\xE6" "%c" "%c" "%c" "%c",
@@ -45,23 +189,27 @@ int comm_command(int tty, unsigned char command, unsigned char argument,
   if (write(tty, cmd, cmd_size) == -1)
     error(1, errno, "%s.%d: write()", __FILE__, __LINE__);
 
-  usleep(10000);
-
-read_again:
-  response_size = read(tty, response, sizeof(response));
-
-  if (response_size == -1) {
-    if (errno == EAGAIN) {
-      if (read_timeout)
-        error(1, 0, "%s.%d: Camera not responding.", __FILE__, __LINE__);
-      else {
-        read_timeout = 1;
-        sleep(3);
-        goto read_again;
-      }
+  if (size > sizeof(response))
+    error(1, 0, "%s.%d: Invalid response size: %zu", __FILE__, __LINE__,
+      size);
+  if (size > 0) {
+    read_exact(tty, response, size, 0);
+    response_size = size;
+  } else {
+    /* Wait for the response to start, then read until the line is
+       quiet. */
+    response_size = read_poll(tty, response, sizeof(response), comm_timeout,
+      0);
+    if (response_size == 0)
+      error(1, 0, "%s.%d: Camera not responding.", __FILE__, __LINE__);
+  }
 
-    } else
-      error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+  while (size == 0 && response_size < sizeof(response)) {
+    data_read = read_poll(tty, response + response_size,
+      sizeof(response) - response_size, COMM_RESPONSE_GAP, 0);
+    if (data_read == 0)
+      break;
+    response_size += data_read;
   }
 
 #ifdef COMM_DEBUG
@@ -70,7 +218,8 @@ read_again:
   fprintf(stderr, "\n");
 #endif
 
-  /* Note: Checksum is not verified. A possible improvement? */
+  /* Note: The checksum format of responses is not known, so these are not
+     verified. */
 
   if (response_callback != NULL)
     return response_callback(response, response_size);
@@ -80,107 +229,331 @@ read_again:
 
 
 
-static void progress_bar(long total, long remaining)
+/* Draw the progress bar with the average data rate, at most once every
+   COMM_PROGRESS_INTERVAL ms until the transfer is done. */
+static void progress(transfer_t *transfer, long done)
 {
-  int i;
+  int i, n;
+  int64_t now, elapsed;
+  char line[128];
+
+  now = stats_clock();
+  if (done < transfer->size &&
+    now - transfer->progress < (int64_t)COMM_PROGRESS_INTERVAL * 1000000)
+    return;
+  transfer->progress = now;
+
+  n = snprintf(line, sizeof(line), "\r|");
+  for (i = 0; i < 50; i++)
+    line[n++] = ((long)i * transfer->size < (long)done * 50) ? '#' : ' ';
+
+  elapsed = now - transfer->start;
+  n += snprintf(line + n, sizeof(line) - n, "| %ld/%ld %.1f kB/s ", done,
+    transfer->size, (elapsed > 0) ? transfer->received * 1e6 / elapsed : 0);
+
+  fputs(line, stdout);
+  if (done == transfer->size) {
+    fputs("\n", stdout);
+    transfer->progress_shown = 0;
+  } else
+    transfer->progress_shown = 1;
+  fflush(stdout);
+}
+
 
-  printf("\r|");
-  for (i = 0; i < 60; i++) {
-    if (i * (total / 60) > total - remaining)
-      printf(" ");
-    else
-      printf("#");
-  }
-  printf("| %lu/%lu", total - remaining, total);
 
-  if (remaining == 0)
+/* End the progress bar line, before printing something else. */
+static void progress_break(transfer_t *transfer)
+{
+  if (transfer->progress_shown)
     printf("\n");
+  transfer->progress_shown = 0;
 }
 
 
 
-void comm_get_picture_data(int tty, char picture_no, long size,
-  unsigned char *out)
+/* Checksum of a picture data frame. */
+/* Note: The algorithm is not documented, and has not been confirmed with a
+   real camera. It is assumed to be the 16 bit sum of the data bytes, like
+   many similar cameras use. A frame received twice with the same data and
+   the same mismatching checksum is not a line error. If no frame has
+   matched so far, the assumption is wrong, so a warning is given and
+   verification is turned off. Otherwise the picture seems to be corrupt
+   on the camera, and the transfer is stopped. */
+static unsigned int frame_checksum(const unsigned char *data, int size)
 {
-  char buffer[2048]; /* Camera internal buffer reported to be 2000 bytes. */
-  int buffer_size, limit, data_read, data_written;
-  long original_size = size;
+  int i;
+  unsigned int sum = 0;
 
-  snprintf(buffer, sizeof(buffer), "\xE6\xE6\xE6\xE6\x05" "%c" "\xFA" "%c",
+  for (i = 0; i < size; i++)
+    sum += data[i];
+
+  return sum & 0xFFFF;
+}
+
+
+
+static void request_picture(int tty, char picture_no)
+{
+  char cmd[16];
+
+  snprintf(cmd, sizeof(cmd), "\xE6\xE6\xE6\xE6\x05" "%c" "\xFA" "%c",
     picture_no, picture_no ^ 0xFF);
-  buffer_size = 8;
 
 #ifdef COMM_DEBUG
   fprintf(stderr, ">");
-  dump_hex(buffer, buffer_size);
+  dump_hex(cmd, 8);
   fprintf(stderr, "\n");
 #endif
 
-  if (write(tty, buffer, buffer_size) == -1)
+  if (write(tty, cmd, 8) == -1)
     error(1, errno, "%s.%d: write()", __FILE__, __LINE__);
+}
 
-  data_written = 0;
-  while (size > 0) {
-    usleep(10000);
+
+
+/* Discard data until the camera has stopped sending. */
+static void drain(int tty)
+{
+  char buffer[2048];
+
+  while (read_poll(tty, buffer, sizeof(buffer), COMM_DRAIN_GAP, 0) > 0)
+    ;
+}
+
+
+
+/* Add a frame latency to the histogram. */
+static void count_latency(int64_t latency)
+{
+  int bucket;
+
+  for (bucket = 0; bucket < COMM_LATENCY_BUCKETS - 1; bucket++) {
+    if (latency < ((int64_t)1 << bucket) * 1000000)
+      break;
+  }
+  comm_stats.latency[bucket]++;
+}
+
+
+
+/* Note: There is no known command to request data from an offset, so a
+   transfer with a bad frame is restarted from the beginning. Frames
+   already verified are skipped, and only the data from the bad frame and
+   onwards is written to out. */
+void comm_get_picture_data(int tty, char picture_no, long size,
+  unsigned char *out)
+{
+  unsigned char header[5], trailer[2];
+  unsigned char skipped[COMM_FRAME_SIZE], failed[COMM_FRAME_SIZE];
+  unsigned char *frame;
+  int n, limit, data_read, retries, checksum, failed_checksum, bad;
+  long offset, verified, failed_offset, stalls;
+  int64_t frame_start, latency, wait_ns, read_ns, now;
+  const char *status;
+  transfer_t transfer;
+
+  retries = 0;
+  verified = 0;      /* Data before this offset has been verified. */
+  failed_offset = -1; /* Offset of the last frame with a bad checksum. */
+  failed_checksum = -1;
+
+  transfer.picture_no = picture_no;
+  transfer.size = size;
+  transfer.received = 0;
+  transfer.start = stats_clock();
+  transfer.progress = 0;
+  transfer.progress_shown = 0;
+  stalls = comm_stats.stalls;
+
+  request_picture(tty, picture_no);
+  frame_start = stats_clock();
+
+  offset = 0;
+  while (offset < size) {
+    wait_ns = comm_stats.wait_ns;
+    read_ns = comm_stats.read_ns;
 
     /* Read initial 5 byte frame header first. */
-    data_read = read(tty, buffer, 5);
-    if (data_read == -1)
-      error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+    read_exact(tty, header, 5, 1);
+    latency = stats_clock() - frame_start;
 
 #ifdef COMM_DEBUG
     fprintf(stderr, "<");
-    dump_hex(buffer, 5);
+    dump_hex((char *)header, 5);
     fprintf(stderr, "\n");
 #endif
 
-    if (buffer[0] != 0x04)
+    if (header[0] != 0x04) {
+      progress_break(&transfer);
       error(0, 0, "%s.%d: Wrong picture data frame header: 0x%02X",
-        __FILE__, __LINE__, buffer[0]);
+        __FILE__, __LINE__, header[0]);
+    }
 
-    if (size > 2000)
-      limit = 2000;
+    if (size - offset > COMM_FRAME_SIZE)
+      limit = COMM_FRAME_SIZE;
     else
-      limit = size;
+      limit = size - offset;
 
+    /* Write data straight to caller's given memory location, unless the
+       frame is a verified one being skipped. */
+    frame = (offset < verified) ? skipped : out + offset;
     data_read = 0;
-    while (limit > 0) {
-      data_read = read(tty, buffer, limit);
-      if (data_read == -1) {
-        if (errno == EAGAIN) {
-          usleep(1000);
-          continue;
-        } else
-          error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+    while (data_read < limit) {
+      n = read_poll(tty, frame + data_read, limit - data_read, comm_timeout,
+        1);
+      if (n == 0) {
+        progress_break(&transfer);
+        error(1, 0, "%s.%d: Camera not responding.", __FILE__, __LINE__);
       }
-      limit -= data_read;
-      size -= data_read;
+      data_read += n;
+
+      if (offset >= verified) {
+        transfer.received += n;
+        progress(&transfer, offset + data_read);
+      }
+    }
 
 #ifdef COMM_DEBUG
-      fprintf(stderr, "<");
-      dump_hex(buffer, data_read);
-      fprintf(stderr, "\n");
+    fprintf(stderr, "<");
+    dump_hex((char *)frame, limit);
+    fprintf(stderr, "\n");
 #endif
-      
-      /* Write back data to caller's given memory location. */
-      memcpy(out + data_written, buffer, data_read);
-      data_written += data_read;
-     
-      progress_bar(original_size, size); 
-      usleep(1000);
-    }
 
     /* Read final 2 byte checksum. */
-    data_read = read(tty, buffer, 2);
-    if (data_read == -1)
-      error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+    read_exact(tty, trailer, 2, 1);
 
 #ifdef COMM_DEBUG
     fprintf(stderr, "<");
-    dump_hex(buffer, 2);
+    dump_hex((char *)trailer, 2);
     fprintf(stderr, "\n");
 #endif
+
+    comm_stats.bytes += limit;
+    count_latency(latency);
+
+    checksum = (trailer[0] << 8) | trailer[1];
+    bad = 0;
+    if (offset < verified)
+      status = "skipped";
+    else if (! comm_verify)
+      status = "unverified";
+    else if (checksum != frame_checksum(frame, limit)) {
+      status = "bad";
+      bad = 1;
+    } else
+      status = "ok";
+
+    now = stats_clock();
+    if (comm_telemetry_fd != -1)
+      dprintf(comm_telemetry_fd, "{\"event\":\"frame\",\"picture\":%d,"
+        "\"offset\":%ld,\"size\":%d,\"status\":\"%s\",\"latency_us\":%lld,"
+        "\"time_us\":%lld,\"wait_us\":%lld,\"read_us\":%lld}\n",
+        picture_no, offset, limit, status, (long long)latency / 1000,
+        (long long)(now - frame_start) / 1000,
+        (long long)(comm_stats.wait_ns - wait_ns) / 1000,
+        (long long)(comm_stats.read_ns - read_ns) / 1000);
+    frame_start = now;
+
+    if (offset < verified) {
+      offset += limit;
+      continue;
+    }
+    comm_stats.frames++;
+
+    if (bad) {
+      comm_stats.checksum_errors++;
+
+      progress_break(&transfer);
+      if (failed_offset == offset && failed_checksum == checksum &&
+        memcmp(failed, frame, limit) == 0) {
+        if (comm_stats.frames_verified > 0)
+          error(1, 0, "%s.%d: Checksum 0x%04X received twice for the same "
+            "data at offset %ld, picture %d seems to be corrupt on the "
+            "camera. Use -k to skip verification.",
+            __FILE__, __LINE__, checksum, offset, picture_no);
+
+        error(0, 0, "%s.%d: Warning: Checksum 0x%04X received twice for "
+          "the same data at offset %ld, and no frame has matched. The "
+          "checksum algorithm is not confirmed, and seems to be wrong for "
+          "this camera. Verification disabled, use -k to skip it.",
+          __FILE__, __LINE__, checksum, offset);
+        comm_verify = 0;
+        offset += limit;
+        continue;
+      }
+
+      if (retries == COMM_MAX_RETRIES)
+        error(1, 0, "%s.%d: Too many checksum errors in picture %d.",
+          __FILE__, __LINE__, picture_no);
+      retries++;
+      comm_stats.retries++;
+
+      error(0, 0, "%s.%d: Checksum error at offset %ld, retrying.",
+        __FILE__, __LINE__, offset);
+
+      memcpy(failed, frame, limit);
+      failed_offset = offset;
+      failed_checksum = checksum;
+      verified = offset;
+
+      drain(tty);
+      request_picture(tty, picture_no);
+      frame_start = stats_clock();
+      offset = 0;
+      continue;
+    } else if (comm_verify)
+      comm_stats.frames_verified++;
+
+    offset += limit;
   }
 
+  now = stats_clock();
+  comm_stats.pictures++;
+  comm_stats.transfer_ns += now - transfer.start;
+  comm_stats.retry_count[retries]++;
+
+  if (comm_telemetry_fd != -1)
+    dprintf(comm_telemetry_fd, "{\"event\":\"picture\",\"picture\":%d,"
+      "\"size\":%ld,\"time_us\":%lld,\"bytes_per_s\":%.0f,\"retries\":%d,"
+      "\"stalls\":%ld}\n",
+      picture_no, size, (long long)(now - transfer.start) / 1000,
+      (now > transfer.start) ? size * 1e9 / (now - transfer.start) : 0,
+      retries, comm_stats.stalls - stalls);
+}
+
+
+
+static void telemetry_array(const char *key, const long values[], int count)
+{
+  int i;
+
+  dprintf(comm_telemetry_fd, ",\"%s\":[", key);
+  for (i = 0; i < count; i++)
+    dprintf(comm_telemetry_fd, (i == 0) ? "%ld" : ",%ld", values[i]);
+  dprintf(comm_telemetry_fd, "]");
 }
 
+
+
+/* Write the statistics for all pictures transferred to the telemetry file
+   descriptor, if there is one. */
+void comm_finish_telemetry(void)
+{
+  if (comm_telemetry_fd == -1)
+    return;
+
+  dprintf(comm_telemetry_fd, "{\"event\":\"summary\",\"pictures\":%ld,"
+    "\"bytes\":%ld,\"time_us\":%lld,\"wait_us\":%lld,\"read_us\":%lld,"
+    "\"frames\":%ld,\"checksum_errors\":%ld,\"retries\":%ld,\"stalls\":%ld",
+    comm_stats.pictures, comm_stats.bytes,
+    (long long)comm_stats.transfer_ns / 1000,
+    (long long)comm_stats.wait_ns / 1000,
+    (long long)comm_stats.read_ns / 1000, comm_stats.frames,
+    comm_stats.checksum_errors, comm_stats.retries, comm_stats.stalls);
+  telemetry_array("latency_ms_log2", comm_stats.latency,
+    COMM_LATENCY_BUCKETS);
+  telemetry_array("retry_count", comm_stats.retry_count,
+    COMM_MAX_RETRIES + 1);
+  dprintf(comm_telemetry_fd, "}\n");
+}
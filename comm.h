@@ -1,10 +1,42 @@
 #ifndef _COMM_H
 #define _COMM_H
 
+#include <stdint.h>
 #include <stdlib.h> /* size_t */
 
+/* Default time to wait for the camera, in ms. */
+#define COMM_DEFAULT_TIMEOUT 3000
+
+/* Times a picture transfer is restarted after checksum errors. */
+#define COMM_MAX_RETRIES 5
+
+/* Frame latency histogram buckets, bucket n counts latencies below 2^n ms
+   and the last one all that are longer. */
+#define COMM_LATENCY_BUCKETS 12
+
+/* Picture data transfer statistics. */
+typedef struct comm_stats_s {
+  long frames;          /* Frames received, not counting skipped ones. */
+  long frames_verified; /* Frames with a matching checksum. */
+  long checksum_errors;
+  long retries;         /* Transfers restarted after a checksum error. */
+  long pictures;
+  long bytes;           /* Picture data received, including skipped frames. */
+  int64_t transfer_ns;  /* Time from requests until the last frames. */
+  int64_t wait_ns;      /* Time spent waiting for data from the camera. */
+  int64_t read_ns;      /* Time spent reading data. */
+  long stalls;          /* Waits for data longer than COMM_STALL_GAP. */
+  long latency[COMM_LATENCY_BUCKETS]; /* Frames by time to the header. */
+  long retry_count[COMM_MAX_RETRIES + 1]; /* Pictures by retries needed. */
+} comm_stats_t;
+
+void comm_set_timeout(int timeout);
+void comm_set_verify(int verify);
+void comm_set_telemetry(int fd);
+void comm_get_stats(comm_stats_t *stats);
+void comm_finish_telemetry(void);
 int comm_command(int tty, unsigned char command, unsigned char argument,
-  int (*response_callback)(char *, size_t));
+  size_t size, int (*response_callback)(char *, size_t));
 void comm_get_picture_data(int tty, char picture_no, long size, 
   unsigned char *out);
 
@@ -0,0 +1,168 @@
+#include "convert.h"
+#include "jpeg.h"
+#include "pnm.h"
+#include <stdio.h>
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+
+/* Conversion of downloaded (or dumped) picture data to output files. */
+
+
+
+/* Open a new file without overwriting an old one. */
+/* Returns NULL on error, so one failing file does not stop a batch. */
+FILE *convert_open_file(const char *base, char *extension)
+{
+  int try;
+  char name[PATH_MAX];
+  FILE *fh;
+
+  for (try = 0; ; try++) {
+    if (try == 0)
+      snprintf(name, sizeof(name), "%s.%s", base, extension);
+    else
+      snprintf(name, sizeof(name), "%s.%s.%d", base, extension, try);
+
+    /* Note: 'x' is a GNU C library extension. */
+    fh = fopen(name, "wx");
+    if (fh == NULL) {
+      if (errno != EEXIST) {
+        error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+        return NULL;
+      }
+    } else
+      break; /* Opened an exclusive file. */
+
+    /* File already exists, try another one. */
+  }
+  
+  return fh;
+}
+
+
+
+/* Convert picture data to files named from base, like "base.ppm".
+   Counters and timers are added to stats, unless it is NULL. Raw output
+   decodes the picture once for each component, and counts every pass.
+   Returns 0 on success, or -1 on error. */
+int convert_picture(const unsigned char *picture_data, size_t size,
+  const convert_options_t *options, const char *base, stats_t *stats)
+{
+  int j, result = 0;
+  char *component_ext[4] = {"y1.pgm", "cb.pgm", "cr.pgm", "y2.pgm"};
+  FILE *output_file;
+  jpeg_t jpeg;
+  pnm_t pnm;
+
+  if (size < 6) {
+    error(0, 0, "%s.%d: Picture data too small: %zu",
+      __FILE__, __LINE__, size);
+    return -1;
+  }
+
+  if (stats != NULL)
+    stats->bytes += size;
+
+  /* Note: Skip 6 first bytes when decoding. This is some fake header, and
+     not valid JPEG data. */
+  switch (options->output_type) {
+  case OUTPUT_COLOR:
+    output_file = convert_open_file(base, "ppm");
+    if (output_file == NULL)
+      return -1;
+    pnm_init(&pnm, output_file, 0, 1, options->scale,
+      options->ascii);
+    pnm.stats = stats;
+    pnm_set_filter(&pnm, options->despeckle, options->sharpen);
+    /* Quantization value 4 for luminance and 2 for each chrominace
+       component seems to produce the best overall result for all pictures.
+       Note: The colors will be a bit pale. */
+    jpeg_init(&jpeg, 4, 2, 2, options->idct);
+    jpeg_set_scale(&jpeg, options->scale);
+    jpeg.stats = stats;
+    if (options->quantization != NULL)
+      jpeg_set_quantization(&jpeg, options->quantization);
+    result = jpeg_decode(&jpeg, picture_data + 6, size - 6,
+      pnm_block_to_ppm, &pnm);
+    jpeg_free(&jpeg);
+    if (pnm_finish(&pnm) == -1)
+      result = -1;
+    fclose(output_file);
+    break;
+
+  case OUTPUT_GREY:
+    output_file = convert_open_file(base, "pgm");
+    if (output_file == NULL)
+      return -1;
+    pnm_init(&pnm, output_file, 0, 0, options->scale,
+      options->ascii);
+    pnm.stats = stats;
+    pnm_set_filter(&pnm, options->despeckle, options->sharpen);
+    /* Lumiance quantzation of 4 seems to be about right. */
+    jpeg_init(&jpeg, 4, 0, 0, options->idct);
+    jpeg_set_scale(&jpeg, options->scale);
+    jpeg.stats = stats;
+    if (options->quantization != NULL)
+      jpeg_set_quantization(&jpeg, options->quantization);
+    result = jpeg_decode(&jpeg, picture_data + 6, size - 6,
+      pnm_component_to_pgm, &pnm);
+    jpeg_free(&jpeg);
+    if (pnm_finish(&pnm) == -1)
+      result = -1;
+    fclose(output_file);
+    break;
+
+  case OUTPUT_RAW:
+    /* No quantization for the components, needs to be handled by
+       an external tool later. */
+    jpeg_init(&jpeg, 1, 1, 1, options->idct);
+    jpeg_set_scale(&jpeg, options->scale);
+    jpeg.stats = stats;
+    for (j = 0; j < 4 && result == 0; j++) {
+      output_file = convert_open_file(base, component_ext[j]);
+      if (output_file == NULL) {
+        result = -1;
+        break;
+      }
+      pnm_init(&pnm, output_file, j, 0, options->scale,
+        options->ascii);
+      pnm.stats = stats;
+      pnm_set_filter(&pnm, options->despeckle, options->sharpen);
+      result = jpeg_decode(&jpeg, picture_data + 6, size - 6,
+        pnm_component_to_pgm, &pnm);
+      if (pnm_finish(&pnm) == -1)
+        result = -1;
+      fclose(output_file);
+    }
+    jpeg_free(&jpeg);
+    break;
+
+  case OUTPUT_JPEG:
+    output_file = convert_open_file(base, "jpg");
+    if (output_file == NULL)
+      return -1;
+    /* The coefficients are kept, with the quantization of color output. */
+    jpeg_init(&jpeg, 4, 2, 2, options->idct);
+    if (options->quantization != NULL)
+      jpeg_set_quantization(&jpeg, options->quantization);
+    result = jpeg_transcode(&jpeg, picture_data + 6, size - 6, output_file);
+    jpeg_free(&jpeg);
+    fclose(output_file);
+    break;
+
+  case OUTPUT_NODEC:
+    output_file = convert_open_file(base, "dat");
+    if (output_file == NULL)
+      return -1;
+    if (fwrite(picture_data, sizeof(char), size, output_file) != size)
+      result = -1;
+    fclose(output_file);
+    break;
+
+  default:
+    break;
+  }
+
+  return result;
+}
@@ -0,0 +1,33 @@
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+#include "idct.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h> /* size_t */
+
+typedef enum {
+  OUTPUT_NONE,
+  OUTPUT_COLOR,
+  OUTPUT_GREY,
+  OUTPUT_RAW,
+  OUTPUT_JPEG,
+  OUTPUT_NODEC,
+  OUTPUT_ERASE,
+} output_type_t;
+
+typedef struct convert_options_s {
+  output_type_t output_type;
+  idct_method_t idct;
+  int ascii; /* Plain (ASCII) instead of binary PNM output. */
+  int scale; /* Output size divided by 1, 2, 4 or 8. */
+  int (*quantization)[64]; /* Tables for color and grey output, or NULL. */
+  int despeckle; /* Post-processing, see pnm_set_filter(). */
+  int sharpen;
+} convert_options_t;
+
+FILE *convert_open_file(const char *base, char *extension);
+int convert_picture(const unsigned char *picture_data, size_t size,
+  const convert_options_t *options, const char *base, stats_t *stats);
+
+#endif /* _CONVERT_H */
@@ -0,0 +1,75 @@
+#include "dump.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Access to picture dump files without a camera. */
+
+
+
+/* Returns 0 on success, or -1 on error. */
+int dump_map(const char *name, dump_t *dump)
+{
+  int fd;
+  struct stat st;
+
+  fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    error(0, errno, "%s.%d: open(): %s", __FILE__, __LINE__, name);
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    error(0, errno, "%s.%d: fstat(): %s", __FILE__, __LINE__, name);
+    close(fd);
+    return -1;
+  }
+
+  dump->size = st.st_size;
+  if (dump->size == 0) {
+    dump->data = NULL; /* Not possible to map, but still a valid file. */
+    close(fd);
+    return 0;
+  }
+
+  dump->data = mmap(NULL, dump->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); /* Mapping stays valid. */
+  if (dump->data == MAP_FAILED) {
+    error(0, errno, "%s.%d: mmap(): %s", __FILE__, __LINE__, name);
+    return -1;
+  }
+
+  /* Data is read once from start to end. */
+  madvise(dump->data, dump->size, MADV_SEQUENTIAL);
+
+  return 0;
+}
+
+
+
+void dump_unmap(dump_t *dump)
+{
+  if (dump->data != NULL)
+    munmap(dump->data, dump->size);
+  dump->data = NULL;
+  dump->size = 0;
+}
+
+
+
+/* Output files are written alongside the dump, "x.dat" converts to "x.ppm",
+   so strip the extension to get a base name. */
+void dump_base_name(const char *name, char *base, size_t base_size)
+{
+  size_t len;
+
+  snprintf(base, base_size, "%s", name);
+  len = strlen(base);
+  if (len > 4 && strcmp(base + len - 4, ".dat") == 0)
+    base[len - 4] = '\0';
+}
@@ -0,0 +1,16 @@
+#ifndef _DUMP_H
+#define _DUMP_H
+
+#include <stdlib.h> /* size_t */
+
+/* Picture dump file, as written with the -n option, mapped into memory. */
+typedef struct dump_s {
+  unsigned char *data;
+  size_t size;
+} dump_t;
+
+int dump_map(const char *name, dump_t *dump);
+void dump_unmap(dump_t *dump);
+void dump_base_name(const char *name, char *base, size_t base_size);
+
+#endif /* _DUMP_H */
@@ -0,0 +1,317 @@
+#include "jpeg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+
+/* Encoder for the camera picture format, the inverse of color conversion
+   in polaroid. Makes picture dumps from 320x240 PPM images, or from
+   generated images with a chosen level of detail. */
+
+
+
+#define WIDTH  320
+#define HEIGHT 240
+
+/* Cosine basis, basis[x][u] = C(u) / 2 * cos((2x + 1) * u * pi / 16). */
+static double basis[8][8];
+
+
+
+static void display_help(void)
+{
+  fprintf(stderr, "\nUsage: polaroid-encode [OPTIONS] INPUT.ppm OUTPUT.dat\n"
+    "       polaroid-encode -g DETAIL [OPTIONS] OUTPUT.dat\n"
+    "\nOptions:\n"
+    "  -h          Display this help and exit.\n"
+    "  -q FILE     Quantization tables, like for polaroid (default is\n"
+    "              4 for luminance and 2 for chrominance).\n"
+    "  -g DETAIL   Generate an image instead of reading one, with DETAIL\n"
+    "              from 0 (smooth) to 100 (noise).\n"
+    "  -r SEED     Random seed for generated images (default 1).\n\n");
+}
+
+
+
+/* Next value from a PPM header, skipping whitespace and comments. */
+static int read_header_value(FILE *fh)
+{
+  int c, value;
+
+  while (1) {
+    c = getc(fh);
+    if (c == '#') {
+      while (c != '\n' && c != EOF)
+        c = getc(fh);
+    } else if (! isspace(c))
+      break;
+  }
+  ungetc(c, fh);
+
+  if (fscanf(fh, "%d", &value) != 1)
+    return -1;
+  return value;
+}
+
+
+
+/* Read a binary (P6) or ASCII (P3) PPM of exactly 320x240 pixels. */
+static void read_ppm(const char *name, unsigned char *rgb)
+{
+  FILE *fh;
+  int i, value, binary;
+  char magic[3] = {0};
+
+  fh = fopen(name, "r");
+  if (fh == NULL)
+    error(1, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+
+  if (fread(magic, 1, 2, fh) != 2 ||
+    (strcmp(magic, "P6") != 0 && strcmp(magic, "P3") != 0))
+    error(1, 0, "%s.%d: Not a PPM image: %s", __FILE__, __LINE__, name);
+  binary = (magic[1] == '6');
+
+  if (read_header_value(fh) != WIDTH || read_header_value(fh) != HEIGHT)
+    error(1, 0, "%s.%d: Image must be %dx%d pixels: %s",
+      __FILE__, __LINE__, WIDTH, HEIGHT, name);
+  if (read_header_value(fh) != 255)
+    error(1, 0, "%s.%d: Max-val must be 255: %s", __FILE__, __LINE__, name);
+
+  if (binary) {
+    getc(fh); /* Single whitespace after the header. */
+    if (fread(rgb, 1, WIDTH * HEIGHT * 3, fh) != WIDTH * HEIGHT * 3)
+      error(1, 0, "%s.%d: Image data too short: %s",
+        __FILE__, __LINE__, name);
+  } else {
+    for (i = 0; i < WIDTH * HEIGHT * 3; i++) {
+      value = read_header_value(fh);
+      if (value < 0 || value > 255)
+        error(1, 0, "%s.%d: Invalid image data: %s",
+          __FILE__, __LINE__, name);
+      rgb[i] = value;
+    }
+  }
+
+  fclose(fh);
+}
+
+
+
+/* Smooth gradients with ripples, mixed with noise as detail increases. */
+static void generate_image(int detail, unsigned int seed, unsigned char *rgb)
+{
+  int x, y, c, value;
+  double amount, frequency, smooth, noise;
+
+  amount = detail / 100.0;
+  frequency = 0.02 + amount * 0.5;
+  srand(seed);
+
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      for (c = 0; c < 3; c++) {
+        smooth = 128 + 60 * sin((x + c * 40) * frequency) *
+          cos((y - c * 30) * frequency * 0.7) + (x - WIDTH / 2) * 0.2;
+        noise = (rand() % 256) - 128;
+        value = (1 - amount) * smooth + amount * (128 + noise);
+        rgb[(y * WIDTH + x) * 3 + c] = (value < 0) ? 0 :
+          (value > 255) ? 255 : value;
+      }
+    }
+  }
+}
+
+
+
+static void fdct(const double in[64], double out[64])
+{
+  int x, y, u, v;
+  double tmp[64], sum;
+
+  /* Rows, then columns. */
+  for (y = 0; y < 8; y++) {
+    for (u = 0; u < 8; u++) {
+      sum = 0;
+      for (x = 0; x < 8; x++)
+        sum += in[y * 8 + x] * basis[x][u];
+      tmp[y * 8 + u] = sum;
+    }
+  }
+  for (u = 0; u < 8; u++) {
+    for (v = 0; v < 8; v++) {
+      sum = 0;
+      for (y = 0; y < 8; y++)
+        sum += tmp[y * 8 + u] * basis[y][v];
+      out[v * 8 + u] = sum;
+    }
+  }
+}
+
+
+
+/* Forward DCT and quantization of level shifted samples, giving
+   coefficients in zig-zag order. */
+static void encode_block(const double samples[64], const int quant[64],
+  int coef[64])
+{
+  int i, q, value;
+  double dct[64];
+
+  fdct(samples, dct);
+  for (i = 0; i < 64; i++) {
+    q = quant[jpeg_zig_zag_natural[i]];
+    if (q == 0) {
+      coef[i] = 0;
+      continue;
+    }
+    value = lround(dct[jpeg_zig_zag_natural[i]] / q);
+    if (value > 1023)
+      value = 1023;
+    if (value < -1023)
+      value = -1023;
+    coef[i] = value;
+  }
+}
+
+
+
+/* The picture data holds a stripe of 20 blocks in width for each of
+   Y1, Cb, Cr and Y2, where each sample is shown as two pixels in width and
+   two rows in height. The luminance components form a chess-board, and
+   chrominance covers all four pixels. */
+static void encode_image(const unsigned char *rgb, int quant[3][64],
+  jpeg_encoder_t *encoder)
+{
+  int i, j, stripe, col, row, x, y, px, py, block_no;
+  double r, g, b;
+  double luminance[2][2], chroma_b, chroma_r;
+  double samples[4][64];
+  int coef[64];
+
+  block_no = 0;
+  for (stripe = 0; stripe < HEIGHT / 16; stripe++) {
+    for (col = 0; col < WIDTH / 16; col++) {
+      for (row = 0; row < 8; row++) {
+        for (i = 0; i < 8; i++) {
+          chroma_b = chroma_r = 0;
+          for (y = 0; y < 2; y++) {
+            for (x = 0; x < 2; x++) {
+              px = col * 16 + i * 2 + x;
+              py = stripe * 16 + row * 2 + y;
+              r = rgb[(py * WIDTH + px) * 3];
+              g = rgb[(py * WIDTH + px) * 3 + 1];
+              b = rgb[(py * WIDTH + px) * 3 + 2];
+              luminance[y][x] = 0.299 * r + 0.587 * g + 0.114 * b;
+              chroma_b += -0.168736 * r - 0.331264 * g + 0.5 * b;
+              chroma_r += 0.5 * r - 0.418688 * g - 0.081312 * b;
+            }
+          }
+
+          /* Level shifted by 128, as for the decoder. */
+          j = row * 8 + i;
+          samples[0][j] = (luminance[0][0] + luminance[1][1]) / 2 - 128;
+          samples[1][j] = chroma_b / 4;
+          samples[2][j] = chroma_r / 4;
+          samples[3][j] = (luminance[0][1] + luminance[1][0]) / 2 - 128;
+        }
+      }
+
+      /* Blocks are ordered Y1, Cb, Cr, Y2. */
+      for (i = 0; i < 4; i++) {
+        encode_block(samples[i], quant[(i == 3) ? 0 : i], coef);
+        jpeg_encode_block(encoder, coef, block_no % 4);
+        block_no++;
+      }
+    }
+  }
+  jpeg_encoder_finish(encoder);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c, i, x, u, detail = -1;
+  unsigned int seed = 1;
+  int quant[3][64];
+  unsigned char *rgb;
+  unsigned char header[6] = {0};
+  jpeg_encoder_t encoder;
+  FILE *fh;
+
+  for (i = 0; i < 64; i++) {
+    quant[0][i] = 4;
+    quant[1][i] = 2;
+    quant[2][i] = 2;
+  }
+
+  while ((c = getopt(argc, argv, "hq:g:r:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help();
+      return 0;
+
+    case 'q':
+      if (jpeg_read_quantization(optarg, quant) == -1)
+        return 1;
+      break;
+
+    case 'g':
+      detail = atoi(optarg);
+      if (detail < 0 || detail > 100)
+        error(1, 0, "%s.%d: Detail must be 0 to 100: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 'r':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+
+    case '?':
+    default:
+      display_help();
+      return 1;
+    }
+  }
+
+  if (argc - optind != ((detail == -1) ? 2 : 1)) {
+    display_help();
+    return 1;
+  }
+
+  for (x = 0; x < 8; x++)
+    for (u = 0; u < 8; u++)
+      basis[x][u] = ((u == 0) ? M_SQRT1_2 : 1.0) / 2 *
+        cos((2 * x + 1) * u * M_PI / 16);
+
+  rgb = malloc(WIDTH * HEIGHT * 3);
+  if (rgb == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  if (detail == -1)
+    read_ppm(argv[optind++], rgb);
+  else
+    generate_image(detail, seed, rgb);
+
+  jpeg_encoder_init(&encoder);
+  encode_image(rgb, quant, &encoder);
+
+  fh = fopen(argv[optind], "w");
+  if (fh == NULL)
+    error(1, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, argv[optind]);
+
+  /* Note: The 6 byte header is not understood, and skipped by the decoder,
+     so it is just zeroes. */
+  fwrite(header, 1, sizeof(header), fh);
+  fwrite(encoder.data, 1, encoder.size, fh);
+  if (fclose(fh) == EOF)
+    error(1, errno, "%s.%d: fclose(): %s", __FILE__, __LINE__, argv[optind]);
+
+  jpeg_encoder_free(&encoder);
+  free(rgb);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+/* Called for each filtered row, with the sink passed to the filter. */
+typedef void (*filter_emit_t)(void *sink, const unsigned char *row);
+
+/* Post-processing state, rows are filtered as they are pushed. Each stage
+   needs the row below, so output is two rows behind the input. */
+typedef struct filter_s {
+  int despeckle; /* Threshold, or -1 when disabled. */
+  int sharpen;   /* Unsharp mask amount in percent, or 0 when disabled. */
+  int width;     /* Samples in each row, pixels times channels. */
+  int channels;
+  int rows_in;   /* Rows pushed to the despeckle stage. */
+  int rows_mid;  /* Rows pushed to the sharpen stage. */
+  unsigned char *in[3];    /* Last input rows, oldest first. */
+  unsigned char *mid[3];   /* Last despeckled rows, oldest first. */
+  unsigned short *hsum[3]; /* Horizontal 1-2-1 sums of the mid rows. */
+  unsigned char *median;   /* Vertical medians of the row despeckled. */
+  unsigned char *out;
+} filter_t;
+
+void filter_init(filter_t *filter, int width, int channels, int despeckle,
+  int sharpen);
+void filter_push(filter_t *filter, const unsigned char *row,
+  filter_emit_t emit, void *sink);
+void filter_finish(filter_t *filter, filter_emit_t emit, void *sink);
+void filter_free(filter_t *filter);
+
+#endif /* _FILTER_H */
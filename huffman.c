@@ -148,3 +148,101 @@ void huffman_tree_free(huffman_t *root)
   free(root);
 }
 
+
+
+
+/* Function to convert from the table format to the lookup table format.
+   Codes are assigned in canonical order, which gives the same codes as the
+   binary tree format. */
+huffman_lut_t *huffman_convert_lut(unsigned char huffman_table[])
+{
+  int i, j, n, code, length, shift;
+  huffman_lut_t *lut;
+
+  lut = malloc(sizeof(huffman_lut_t));
+  if (lut == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+  memset(lut, 0, sizeof(huffman_lut_t));
+
+  n = 0;
+  code = 0;
+  for (length = 1; length <= 16; length++) {
+    lut->valptr[length] = n;
+    lut->mincode[length] = code;
+
+    for (j = 0; j < huffman_table[length - 1]; j++) {
+      if (code >= (1 << length))
+        error(1, 0, "%s.%d: Unable to allocate huffman code",
+          __FILE__, __LINE__);
+
+      lut->values[n] = huffman_table[16 + n];
+
+      /* Every lookahead index starting with the code resolves to it. */
+      if (length <= HUFFMAN_LOOKAHEAD) {
+        shift = HUFFMAN_LOOKAHEAD - length;
+        for (i = 0; i < (1 << shift); i++) {
+          lut->length[(code << shift) + i] = length;
+          lut->value[(code << shift) + i] = huffman_table[16 + n];
+        }
+      }
+
+      code++;
+      n++;
+    }
+
+    if (huffman_table[length - 1] == 0)
+      lut->maxcode[length] = -1;
+    else
+      lut->maxcode[length] = code - 1;
+
+    code <<= 1;
+  }
+
+  return lut;
+}
+
+
+
+void huffman_lut_free(huffman_lut_t *lut)
+{
+  free(lut);
+}
+
+
+
+/* Canonical codes, assigned the same way as for decoding. */
+huffman_codes_t *huffman_convert_codes(unsigned char huffman_table[])
+{
+  int j, n, code, length;
+  huffman_codes_t *codes;
+
+  codes = malloc(sizeof(huffman_codes_t));
+  if (codes == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+  memset(codes, 0, sizeof(huffman_codes_t));
+
+  n = 0;
+  code = 0;
+  for (length = 1; length <= 16; length++) {
+    for (j = 0; j < huffman_table[length - 1]; j++) {
+      if (code >= (1 << length))
+        error(1, 0, "%s.%d: Unable to allocate huffman code",
+          __FILE__, __LINE__);
+
+      codes->code[huffman_table[16 + n]] = code;
+      codes->length[huffman_table[16 + n]] = length;
+      code++;
+      n++;
+    }
+    code <<= 1;
+  }
+
+  return codes;
+}
+
+
+
+void huffman_codes_free(huffman_codes_t *codes)
+{
+  free(codes);
+}
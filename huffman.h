@@ -7,8 +7,32 @@ typedef struct huffman_s {
   int value;              /* Should be -1 when not in use. */
 } huffman_t;
 
+/* Amount of bits resolved by a single probe in the lookup table. */
+#define HUFFMAN_LOOKAHEAD 9
+
+typedef struct huffman_lut_s {
+  /* Indexed by the next HUFFMAN_LOOKAHEAD bits in the stream. */
+  unsigned char length[1 << HUFFMAN_LOOKAHEAD]; /* 0 if code is longer. */
+  unsigned char value[1 << HUFFMAN_LOOKAHEAD];
+  /* Canonical code ranges for each code length, used by the slow path. */
+  int mincode[17];
+  int maxcode[17];        /* Should be -1 when no codes of this length. */
+  int valptr[17];
+  unsigned char values[256];
+} huffman_lut_t;
+
+/* Code for each value, used for encoding. */
+typedef struct huffman_codes_s {
+  unsigned short code[256];
+  unsigned char length[256]; /* 0 if the value has no code. */
+} huffman_codes_t;
+
 huffman_t *huffman_convert_table(unsigned char huffman_table[]);
 huffman_t *huffman_lookup(huffman_t *node, int bit, int *value);
 void huffman_tree_free(huffman_t *root);
+huffman_lut_t *huffman_convert_lut(unsigned char huffman_table[]);
+void huffman_lut_free(huffman_lut_t *lut);
+huffman_codes_t *huffman_convert_codes(unsigned char huffman_table[]);
+void huffman_codes_free(huffman_codes_t *codes);
 
 #endif /* _HUFFMAN_H */
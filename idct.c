@@ -0,0 +1,494 @@
+#include "idct.h"
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+/* Inverse Discrete Cosine Transform functions. All of them take a block of
+   dequantized coefficients in natural (not zig-zag) order and replace it
+   with the resulting samples, without level shift. */
+
+
+
+/* Divide by 2**n with rounding. */
+#define DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+
+
+/* Basis functions for the separable floating-point IDCT. */
+/* Entry [x][u] is 0.5 * C(u) * cos((2x + 1) * u * PI / 16), calculated on
+   first use, by whichever thread gets there. */
+static double idct_basis[8][8];
+static pthread_once_t idct_basis_once = PTHREAD_ONCE_INIT;
+
+
+
+static void idct_basis_init(void)
+{
+  int x, u;
+
+  for (x = 0; x < 8; x++)
+    for (u = 0; u < 8; u++)
+      idct_basis[x][u] = 0.5 * cos((double)((x + x + 1) * u) *
+        (M_PI / 16.0)) / ((u == 0) ? sqrt(2.0) : 1.0);
+}
+
+
+
+/* IDCT function loosely based on Tom Lane's public domain function. */
+/* Note: Performance have been sacrificed for clarity. */
+void idct_reference(int block[])
+{
+  int x, y, u, v;
+  double v_sum, u_sum;
+  int result[64];
+
+  for (x = 0; x < 8; x++) {
+    for (y = 0; y < 8; y++) {
+
+      v_sum = 0.0;
+      for (v = 0; v < 8; v++) {
+
+        u_sum = 0.0;
+        for (u = 0; u < 8; u++) {
+          u_sum += (double)block[v * 8 + u] * 0.5 *
+            (cos((double)((x + x + 1) * u) * (M_PI / 16.0)) / 
+            (double)((u == 0) ? sqrt(2.0) : 1.0));
+        }
+
+        v_sum += u_sum * 0.5 *
+          (cos((double)((y + y + 1) * v) * (M_PI / 16.0)) / 
+          (double)((v == 0) ? sqrt(2.0) : 1.0));
+      }
+
+      /* Round and store the result. */
+      result[y * 8 + x] = (int)(v_sum < 0.0)
+        ? - (0.5 - v_sum) : v_sum + 0.5;
+    }
+  }
+
+  /* Update whole block with fresh results. */
+  /* Needs to be done afterwards, as block is in use during calculations. */
+  for (x = 0; x < 8; x++)
+    for (y = 0; y < 8; y++)
+      block[y * 8 + x] = result[y * 8 + x];
+}
+
+
+
+/* Same calculation as the reference IDCT, but done as 8 row transforms
+   followed by 8 column transforms, using precalculated basis functions. */
+void idct_float(int block[])
+{
+  int x, y, u, v;
+  double sum, rows[64];
+
+  pthread_once(&idct_basis_once, idct_basis_init);
+
+  /* Rows. */
+  for (v = 0; v < 8; v++) {
+    for (x = 0; x < 8; x++) {
+      sum = 0.0;
+      for (u = 0; u < 8; u++)
+        sum += (double)block[v * 8 + u] * idct_basis[x][u];
+      rows[v * 8 + x] = sum;
+    }
+  }
+
+  /* Columns. */
+  for (x = 0; x < 8; x++) {
+    for (y = 0; y < 8; y++) {
+      sum = 0.0;
+      for (v = 0; v < 8; v++)
+        sum += rows[v * 8 + x] * idct_basis[y][v];
+
+      /* Round and store the result. */
+      block[y * 8 + x] = (int)((sum < 0.0) ? sum - 0.5 : sum + 0.5);
+    }
+  }
+}
+
+
+
+/* Integer IDCT based on the Loeffler, Ligtenberg and Moschytz algorithm,
+   in the same way as the IJG "islow" implementation. The column pass keeps
+   PASS1_BITS of extra precision, which is removed by the row pass. */
+void idct_fast(int block[])
+{
+  int i;
+  int tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+  int z1, z2, z3, z4, z5;
+  int *in, *ws;
+  int workspace[64];
+
+  /* Pass 1: Columns from input, results to workspace. */
+  for (i = 0; i < 8; i++) {
+    in = block + i;
+    ws = workspace + i;
+
+    /* Columns without AC terms are common, and are just the scaled DC. */
+    if (in[8] == 0 && in[16] == 0 && in[24] == 0 && in[32] == 0 &&
+        in[40] == 0 && in[48] == 0 && in[56] == 0) {
+      tmp0 = in[0] << PASS1_BITS;
+      ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] =
+        tmp0;
+      continue;
+    }
+
+    /* Even part. */
+    z2 = in[16];
+    z3 = in[48];
+    z1 = (z2 + z3) * FIX_0_541196100;
+    tmp2 = z1 - z3 * FIX_1_847759065;
+    tmp3 = z1 + z2 * FIX_0_765366865;
+
+    tmp0 = (in[0] + in[32]) << CONST_BITS;
+    tmp1 = (in[0] - in[32]) << CONST_BITS;
+
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+
+    /* Odd part. */
+    tmp0 = in[56];
+    tmp1 = in[40];
+    tmp2 = in[24];
+    tmp3 = in[8];
+
+    z1 = tmp0 + tmp3;
+    z2 = tmp1 + tmp2;
+    z3 = tmp0 + tmp2;
+    z4 = tmp1 + tmp3;
+    z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp0 *= FIX_0_298631336;
+    tmp1 *= FIX_2_053119869;
+    tmp2 *= FIX_3_072711026;
+    tmp3 *= FIX_1_501321110;
+    z1 *= - FIX_0_899976223;
+    z2 *= - FIX_2_562915447;
+    z3 *= - FIX_1_961570560;
+    z4 *= - FIX_0_390180644;
+
+    z3 += z5;
+    z4 += z5;
+
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    ws[0]  = DESCALE(tmp10 + tmp3, CONST_BITS - PASS1_BITS);
+    ws[56] = DESCALE(tmp10 - tmp3, CONST_BITS - PASS1_BITS);
+    ws[8]  = DESCALE(tmp11 + tmp2, CONST_BITS - PASS1_BITS);
+    ws[48] = DESCALE(tmp11 - tmp2, CONST_BITS - PASS1_BITS);
+    ws[16] = DESCALE(tmp12 + tmp1, CONST_BITS - PASS1_BITS);
+    ws[40] = DESCALE(tmp12 - tmp1, CONST_BITS - PASS1_BITS);
+    ws[24] = DESCALE(tmp13 + tmp0, CONST_BITS - PASS1_BITS);
+    ws[32] = DESCALE(tmp13 - tmp0, CONST_BITS - PASS1_BITS);
+  }
+
+  /* Pass 2: Rows from workspace, results back to block. */
+  for (i = 0; i < 8; i++) {
+    ws = workspace + (i * 8);
+    in = block + (i * 8);
+
+    if (ws[1] == 0 && ws[2] == 0 && ws[3] == 0 && ws[4] == 0 &&
+        ws[5] == 0 && ws[6] == 0 && ws[7] == 0) {
+      tmp0 = DESCALE(ws[0], PASS1_BITS + 3);
+      in[0] = in[1] = in[2] = in[3] = in[4] = in[5] = in[6] = in[7] = tmp0;
+      continue;
+    }
+
+    /* Even part. */
+    z2 = ws[2];
+    z3 = ws[6];
+    z1 = (z2 + z3) * FIX_0_541196100;
+    tmp2 = z1 - z3 * FIX_1_847759065;
+    tmp3 = z1 + z2 * FIX_0_765366865;
+
+    tmp0 = (ws[0] + ws[4]) << CONST_BITS;
+    tmp1 = (ws[0] - ws[4]) << CONST_BITS;
+
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+
+    /* Odd part. */
+    tmp0 = ws[7];
+    tmp1 = ws[5];
+    tmp2 = ws[3];
+    tmp3 = ws[1];
+
+    z1 = tmp0 + tmp3;
+    z2 = tmp1 + tmp2;
+    z3 = tmp0 + tmp2;
+    z4 = tmp1 + tmp3;
+    z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp0 *= FIX_0_298631336;
+    tmp1 *= FIX_2_053119869;
+    tmp2 *= FIX_3_072711026;
+    tmp3 *= FIX_1_501321110;
+    z1 *= - FIX_0_899976223;
+    z2 *= - FIX_2_562915447;
+    z3 *= - FIX_1_961570560;
+    z4 *= - FIX_0_390180644;
+
+    z3 += z5;
+    z4 += z5;
+
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    in[0] = DESCALE(tmp10 + tmp3, CONST_BITS + PASS1_BITS + 3);
+    in[7] = DESCALE(tmp10 - tmp3, CONST_BITS + PASS1_BITS + 3);
+    in[1] = DESCALE(tmp11 + tmp2, CONST_BITS + PASS1_BITS + 3);
+    in[6] = DESCALE(tmp11 - tmp2, CONST_BITS + PASS1_BITS + 3);
+    in[2] = DESCALE(tmp12 + tmp1, CONST_BITS + PASS1_BITS + 3);
+    in[5] = DESCALE(tmp12 - tmp1, CONST_BITS + PASS1_BITS + 3);
+    in[3] = DESCALE(tmp13 + tmp0, CONST_BITS + PASS1_BITS + 3);
+    in[4] = DESCALE(tmp13 - tmp0, CONST_BITS + PASS1_BITS + 3);
+  }
+}
+
+
+
+/* Same result as idct_fast() for a block where only the DC coefficient
+   can be non-zero, which fills the block with a single value. */
+void idct_fast_dc(int block[])
+{
+  int i, value;
+
+  value = DESCALE(block[0] << PASS1_BITS, PASS1_BITS + 3);
+  for (i = 0; i < 64; i++)
+    block[i] = value;
+}
+
+
+
+/* Same result as idct_fast() for a block where only the top left 4x4
+   coefficients can be non-zero. Only these are read from the block, and the
+   terms for the other coefficients are left out of the calculation. */
+void idct_fast_4x4(int block[])
+{
+  int i;
+  int tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+  int z1, z2, z3, z4, z5;
+  int *in, *ws;
+  int workspace[64];
+
+  /* Pass 1: Columns from input, results to workspace. */
+  /* Only the 4 left columns, the others are all zero. */
+  for (i = 0; i < 4; i++) {
+    in = block + i;
+    ws = workspace + i;
+
+    if (in[8] == 0 && in[16] == 0 && in[24] == 0) {
+      tmp0 = in[0] << PASS1_BITS;
+      ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] =
+        tmp0;
+      continue;
+    }
+
+    /* Even part. */
+    z2 = in[16];
+    z1 = z2 * FIX_0_541196100;
+    tmp2 = z1;
+    tmp3 = z1 + z2 * FIX_0_765366865;
+
+    tmp0 = in[0] << CONST_BITS;
+
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp0 + tmp2;
+    tmp12 = tmp0 - tmp2;
+
+    /* Odd part. */
+    tmp2 = in[24];
+    tmp3 = in[8];
+
+    z5 = (tmp2 + tmp3) * FIX_1_175875602;
+
+    z1 = tmp3 * - FIX_0_899976223;
+    z2 = tmp2 * - FIX_2_562915447;
+    z3 = tmp2 * - FIX_1_961570560 + z5;
+    z4 = tmp3 * - FIX_0_390180644 + z5;
+
+    tmp0 = z1 + z3;
+    tmp1 = z2 + z4;
+    tmp2 = tmp2 * FIX_3_072711026 + z2 + z3;
+    tmp3 = tmp3 * FIX_1_501321110 + z1 + z4;
+
+    ws[0]  = DESCALE(tmp10 + tmp3, CONST_BITS - PASS1_BITS);
+    ws[56] = DESCALE(tmp10 - tmp3, CONST_BITS - PASS1_BITS);
+    ws[8]  = DESCALE(tmp11 + tmp2, CONST_BITS - PASS1_BITS);
+    ws[48] = DESCALE(tmp11 - tmp2, CONST_BITS - PASS1_BITS);
+    ws[16] = DESCALE(tmp12 + tmp1, CONST_BITS - PASS1_BITS);
+    ws[40] = DESCALE(tmp12 - tmp1, CONST_BITS - PASS1_BITS);
+    ws[24] = DESCALE(tmp13 + tmp0, CONST_BITS - PASS1_BITS);
+    ws[32] = DESCALE(tmp13 - tmp0, CONST_BITS - PASS1_BITS);
+  }
+
+  /* Pass 2: Rows from workspace, results back to block. */
+  /* Only the 4 left values of each row can be non-zero. */
+  for (i = 0; i < 8; i++) {
+    ws = workspace + (i * 8);
+    in = block + (i * 8);
+
+    if (ws[1] == 0 && ws[2] == 0 && ws[3] == 0) {
+      tmp0 = DESCALE(ws[0], PASS1_BITS + 3);
+      in[0] = in[1] = in[2] = in[3] = in[4] = in[5] = in[6] = in[7] = tmp0;
+      continue;
+    }
+
+    /* Even part. */
+    z2 = ws[2];
+    z1 = z2 * FIX_0_541196100;
+    tmp2 = z1;
+    tmp3 = z1 + z2 * FIX_0_765366865;
+
+    tmp0 = ws[0] << CONST_BITS;
+
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp0 + tmp2;
+    tmp12 = tmp0 - tmp2;
+
+    /* Odd part. */
+    tmp2 = ws[3];
+    tmp3 = ws[1];
+
+    z5 = (tmp2 + tmp3) * FIX_1_175875602;
+
+    z1 = tmp3 * - FIX_0_899976223;
+    z2 = tmp2 * - FIX_2_562915447;
+    z3 = tmp2 * - FIX_1_961570560 + z5;
+    z4 = tmp3 * - FIX_0_390180644 + z5;
+
+    tmp0 = z1 + z3;
+    tmp1 = z2 + z4;
+    tmp2 = tmp2 * FIX_3_072711026 + z2 + z3;
+    tmp3 = tmp3 * FIX_1_501321110 + z1 + z4;
+
+    in[0] = DESCALE(tmp10 + tmp3, CONST_BITS + PASS1_BITS + 3);
+    in[7] = DESCALE(tmp10 - tmp3, CONST_BITS + PASS1_BITS + 3);
+    in[1] = DESCALE(tmp11 + tmp2, CONST_BITS + PASS1_BITS + 3);
+    in[6] = DESCALE(tmp11 - tmp2, CONST_BITS + PASS1_BITS + 3);
+    in[2] = DESCALE(tmp12 + tmp1, CONST_BITS + PASS1_BITS + 3);
+    in[5] = DESCALE(tmp12 - tmp1, CONST_BITS + PASS1_BITS + 3);
+    in[3] = DESCALE(tmp13 + tmp0, CONST_BITS + PASS1_BITS + 3);
+    in[4] = DESCALE(tmp13 - tmp0, CONST_BITS + PASS1_BITS + 3);
+  }
+}
+
+
+
+/* Scaled IDCT functions, producing a reduced size block directly from the
+   low frequency coefficients. The input is the top left NxN coefficients,
+   packed row by row with N values in each row, and is replaced with NxN
+   samples packed the same way. The result is an N-point IDCT normalized
+   like the 8-point one, so a flat block keeps its value. */
+
+
+
+/* 4x4 samples, from 4x4 coefficients. */
+void idct_scaled_4x4(int block[])
+{
+  int i;
+  int tmp0, tmp2, tmp10, tmp12;
+  int z1, z2, z3;
+  int *in, *out, *ws;
+  int workspace[16];
+
+  /* Pass 1: Columns from input, results to workspace. */
+  for (i = 0; i < 4; i++) {
+    in = block + i;
+    ws = workspace + i;
+
+    /* Even part. */
+    tmp10 = (in[0] + in[8]) << PASS1_BITS;
+    tmp12 = (in[0] - in[8]) << PASS1_BITS;
+
+    /* Odd part. */
+    z2 = in[4];
+    z3 = in[12];
+    z1 = (z2 + z3) * FIX_0_541196100;
+    tmp0 = DESCALE(z1 + z2 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+    tmp2 = DESCALE(z1 - z3 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
+
+    ws[0]  = tmp10 + tmp0;
+    ws[12] = tmp10 - tmp0;
+    ws[4]  = tmp12 + tmp2;
+    ws[8]  = tmp12 - tmp2;
+  }
+
+  /* Pass 2: Rows from workspace, results back into block. */
+  for (i = 0; i < 4; i++) {
+    ws = workspace + (i * 4);
+    out = block + (i * 4);
+
+    /* Even part. */
+    tmp10 = (ws[0] + ws[2]) << CONST_BITS;
+    tmp12 = (ws[0] - ws[2]) << CONST_BITS;
+
+    /* Odd part. */
+    z2 = ws[1];
+    z3 = ws[3];
+    z1 = (z2 + z3) * FIX_0_541196100;
+    tmp0 = z1 + z2 * FIX_0_765366865;
+    tmp2 = z1 - z3 * FIX_1_847759065;
+
+    out[0] = DESCALE(tmp10 + tmp0, CONST_BITS + PASS1_BITS + 3);
+    out[3] = DESCALE(tmp10 - tmp0, CONST_BITS + PASS1_BITS + 3);
+    out[1] = DESCALE(tmp12 + tmp2, CONST_BITS + PASS1_BITS + 3);
+    out[2] = DESCALE(tmp12 - tmp2, CONST_BITS + PASS1_BITS + 3);
+  }
+}
+
+
+
+/* 2x2 samples, from 2x2 coefficients. */
+void idct_scaled_2x2(int block[])
+{
+  int tmp0, tmp1, tmp2, tmp3;
+
+  /* Note: The 2-point basis is just sum and difference. */
+  tmp0 = block[0] + block[2];
+  tmp1 = block[0] - block[2];
+  tmp2 = block[1] + block[3];
+  tmp3 = block[1] - block[3];
+
+  block[0] = DESCALE(tmp0 + tmp2, 3);
+  block[1] = DESCALE(tmp0 - tmp2, 3);
+  block[2] = DESCALE(tmp1 + tmp3, 3);
+  block[3] = DESCALE(tmp1 - tmp3, 3);
+}
+
+
+
+/* 1x1 sample, the average of the block. */
+void idct_scaled_1x1(int block[])
+{
+  block[0] = DESCALE(block[0], 3);
+}
+
+
+
+/* Returns 0 and sets the method if the name is known, otherwise -1. */
+int idct_method_parse(const char *name, idct_method_t *method)
+{
+  if (strcmp(name, "fast") == 0)
+    *method = IDCT_FAST;
+  else if (strcmp(name, "float") == 0)
+    *method = IDCT_FLOAT;
+  else if (strcmp(name, "ref") == 0)
+    *method = IDCT_REFERENCE;
+  else
+    return -1;
+
+  return 0;
+}
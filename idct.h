@@ -0,0 +1,38 @@
+#ifndef _IDCT_H
+#define _IDCT_H
+
+typedef enum {
+  IDCT_FAST,      /* Separable fixed-point integer (default). */
+  IDCT_FLOAT,     /* Separable floating-point. */
+  IDCT_REFERENCE, /* Straightforward floating-point, very slow. */
+} idct_method_t;
+
+/* Fixed-point constants for the fast integer IDCT, shared with the SIMD
+   kernels. */
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+#define FIX_0_298631336  2446  /* FIX(0.298631336) */
+#define FIX_0_390180644  3196  /* FIX(0.390180644) */
+#define FIX_0_541196100  4433  /* FIX(0.541196100) */
+#define FIX_0_765366865  6270  /* FIX(0.765366865) */
+#define FIX_0_899976223  7373  /* FIX(0.899976223) */
+#define FIX_1_175875602  9633  /* FIX(1.175875602) */
+#define FIX_1_501321110  12299 /* FIX(1.501321110) */
+#define FIX_1_847759065  15137 /* FIX(1.847759065) */
+#define FIX_1_961570560  16069 /* FIX(1.961570560) */
+#define FIX_2_053119869  16819 /* FIX(2.053119869) */
+#define FIX_2_562915447  20995 /* FIX(2.562915447) */
+#define FIX_3_072711026  25172 /* FIX(3.072711026) */
+
+void idct_reference(int block[]);
+void idct_float(int block[]);
+void idct_fast(int block[]);
+void idct_fast_dc(int block[]);
+void idct_fast_4x4(int block[]);
+void idct_scaled_4x4(int block[]);
+void idct_scaled_2x2(int block[]);
+void idct_scaled_1x1(int block[]);
+int idct_method_parse(const char *name, idct_method_t *method);
+
+#endif /* _IDCT_H */
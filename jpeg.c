@@ -1,7 +1,14 @@
+#include "jpeg.h"
 #include "huffman.h"
+#include "idct.h"
+#include "simd.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <error.h>
-#include <math.h>
 
 
 
@@ -29,301 +36,962 @@ static unsigned char huffman_table_ac[] =
 
 
 
-static int power_of_two(int n)
+static void bit_reader_init(jpeg_bit_reader_t *reader,
+  const unsigned char *data, size_t size)
 {
-  if (n == 0)
-    return 1;
-  else
-    return 2 * power_of_two(n - 1);
+  reader->data = data;
+  reader->size = size;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->count = 0;
+  reader->end = 0;
+  reader->error = 0;
 }
 
 
 
-static int next_bit(int (next_byte(void)))
+/* Refill the accumulator with as many whole bytes as will fit. */
+static void fill_bits(jpeg_bit_reader_t *reader)
 {
-  static int c, n = 0;
-
-  if (n == 0) {
-    c = next_byte();
+  int c;
 
-    if (c == -1)
-      return -1;
+  while (reader->count <= 56 && ! reader->end) {
+    if (reader->pos >= reader->size) {
+      reader->end = 1; /* EOF */
+      break;
+    }
+    c = reader->data[reader->pos++];
 
     if (c == 0xFF) { /* JPEG marker. */
-      c = next_byte();
-      if (c == 0x00)
-        c = 0xFF; /* Just set back to 0xFF and continue. */
-      else
-        return -1; /* EOS (or some other) marker. */
+      if (reader->pos >= reader->size || reader->data[reader->pos] != 0x00) {
+        reader->end = 1; /* EOS (or some other) marker. */
+        break;
+      }
+      reader->pos++; /* Just skip the 0x00 and continue. */
     }
+
+    reader->buffer = (reader->buffer << 8) | c;
+    reader->count += 8;
   }
+}
 
-  n--;
-  if (n < 0)
-    n = 7;
 
-  if (c - power_of_two(n) >= 0) {
-    c -= power_of_two(n);
-    return 1;
-  } else
-    return 0;
+
+/* Returns the next bits without consuming them. Missing bits after EOF are
+   padded with zeroes, so the caller must check against the bit count. */
+static int peek_bits(jpeg_bit_reader_t *reader, int n)
+{
+  if (reader->count >= n)
+    return (reader->buffer >> (reader->count - n)) & ((1 << n) - 1);
+  else
+    return (reader->buffer << (n - reader->count)) & ((1 << n) - 1);
 }
 
 
 
-static int receive(int (next_byte(void)), int category)
+static int receive(jpeg_bit_reader_t *reader, int category)
 {
-  int bit;
-  int value = 0;
-  
-  if (category == 0)
+  int value;
+
+  if (reader->count < category)
+    fill_bits(reader);
+  if (reader->count < category) {
+    reader->error = 1; /* Reported by the caller. */
     return 0;
-    
-  while ((bit = next_bit(next_byte)) != -1) {
-    value += (bit * power_of_two(category - 1));
-    category--;
-    if (category <= 0)
-      break; 
   }
- 
-  if (bit == -1)
-    error(1, 0, "%s.%d: Unexpected EOF.", __FILE__, __LINE__);
+
+  reader->count -= category;
+  value = (reader->buffer >> reader->count) & ((1 << category) - 1);
 
   return value;
 }
 
 
 
-static int decode(int (next_byte(void)), huffman_t *table)
+#ifdef JPEG_HUFFMAN_TREE
+static int next_bit(jpeg_bit_reader_t *reader)
+{
+  if (reader->count == 0)
+    fill_bits(reader);
+  if (reader->count == 0)
+    return -1;
+
+  reader->count--;
+  return (reader->buffer >> reader->count) & 1;
+}
+
+
+
+/* Reference decoder, walking the binary tree one bit at a time. */
+static int decode(jpeg_bit_reader_t *reader, huffman_t *table)
 {
   int bit, value;
-  while ((bit = next_bit(next_byte)) != -1) {
+  while ((bit = next_bit(reader)) != -1) {
     table = huffman_lookup(table, bit, &value);
     if (table == NULL)
       return value;
   }
   return -1; /* EOF */
 }
+#else
+/* Lookup table decoder, resolving most codes with a single probe. */
+static int decode(jpeg_bit_reader_t *reader, huffman_lut_t *table)
+{
+  int look, length, code;
+
+  if (reader->count < 16)
+    fill_bits(reader);
+
+  look = peek_bits(reader, HUFFMAN_LOOKAHEAD);
+  length = table->length[look];
+  if (length > 0) {
+    if (length > reader->count)
+      return -1; /* EOF */
+    reader->count -= length;
+    return table->value[look];
+  }
 
+  /* Slow path for codes longer than the lookahead. */
+  code = peek_bits(reader, 16);
+  for (length = HUFFMAN_LOOKAHEAD + 1; length <= 16; length++) {
+    if ((code >> (16 - length)) <= table->maxcode[length]) {
+      if (length > reader->count)
+        return -1; /* EOF */
+      reader->count -= length;
+      return table->values[table->valptr[length] +
+        (code >> (16 - length)) - table->mincode[length]];
+    }
+  }
 
+  if (reader->count < 16)
+    return -1; /* EOF */
+
+  error(0, 0, "%s.%d: Invalid huffman code.", __FILE__, __LINE__);
+  return -1;
+}
+#endif
 
+
+
+/* Values with the top bit cleared are negative, which is fixed up here
+   without branching. Category must be larger than zero. */
 static int extend(int value, int category)
 {
-  if (category == 0)
-    return value;
-  if (value < power_of_two(category - 1))
-    return value + (1 - power_of_two(category));
-  else
-    return value;
+  return value + (((value - (1 << (category - 1))) >> 31) &
+    (int)((~0U << category) + 1));
 }
 
 
 
-static void zig_zag_reorder(int block[])
+/* Position in the 8x8 block for each coefficient in zig-zag order. */
+const int jpeg_zig_zag_natural[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Coefficients up to this zig-zag index are all in the top left 4x4. */
+#define ZIG_ZAG_LAST_4X4 9
+
+
+
+/* Quantization table used by each block in the Y, Cb, Cr, Y sequence. */
+/* Note: Tests have shown that both luminance components can use the same
+   quantization, while the two chrominance components may require different
+   quantization for each one. */
+static const int quantization_component[4] = {0, 1, 2, 0};
+
+
+
+/* Prepare a decoder context, which can be used for several pictures. */
+/* The same quantization value is used for all coefficients of a component,
+   use jpeg_set_quantization() afterwards for per-coefficient tables. */
+void jpeg_init(jpeg_t *jpeg, int yq, int cbq, int crq, idct_method_t idct)
+{
+  int i;
+
+  /* Note: Only lumiance huffman tables are used, even for chrominance. */
+  jpeg->dc = huffman_convert_lut(huffman_table_dc);
+  jpeg->ac = huffman_convert_lut(huffman_table_ac);
+#ifdef JPEG_HUFFMAN_TREE
+  jpeg->dc_tree = huffman_convert_table(huffman_table_dc);
+  jpeg->ac_tree = huffman_convert_table(huffman_table_ac);
+#else
+  jpeg->dc_tree = NULL;
+  jpeg->ac_tree = NULL;
+#endif
+
+  for (i = 0; i < 64; i++) {
+    jpeg->quant[0][i] = yq;
+    jpeg->quant[1][i] = cbq;
+    jpeg->quant[2][i] = crq;
+  }
+  jpeg->idct = idct;
+  jpeg->scale = 1;
+  jpeg->stats = NULL;
+}
+
+
+
+/* Output reduced size blocks, scale is 1, 2, 4 or 8. */
+/* Note: Scaled blocks always use the integer IDCT. */
+void jpeg_set_scale(jpeg_t *jpeg, int scale)
 {
-  int n, x, y;
-  int copy[64];
-
-  for (n = 0; n < 64; n++)
-    copy[n] = block[n];
-  
-  n = x = y = 0; 
-  while (n < 63) {
-    /* Step. */
-    if (x < 7)
-      x++;
-    else
-      y++;
-    block[x + (y * 8)] = copy[++n];
-    
-    /* Down and left until limit. */
-    while (x > 0 && y < 7) {
-      x--;
-      y++;
-      block[x + (y * 8)] = copy[++n];
+  jpeg->scale = scale;
+}
+
+
+
+/* Use quantization tables for luminance, Cb and Cr in natural order. */
+void jpeg_set_quantization(jpeg_t *jpeg, int tables[3][64])
+{
+  int i, j;
+
+  /* Stored in zig-zag order, so each decoded coefficient can be multiplied
+     by the table entry with the same index. */
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 64; j++)
+      jpeg->quant[i][j] = tables[i][jpeg_zig_zag_natural[j]];
+}
+
+
+
+/* Read quantization tables from a text file, as whitespace separated
+   values in natural order with '#' starting a comment. The file holds
+   either one table used for all components, or a table each for
+   luminance, Cb and Cr. Returns 0 on success, or -1 on error. */
+int jpeg_read_quantization(const char *name, int tables[3][64])
+{
+  int c, n, value;
+  FILE *fh;
+
+  fh = fopen(name, "r");
+  if (fh == NULL) {
+    error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+    return -1;
+  }
+
+  n = 0;
+  while (1) {
+    c = getc(fh);
+    if (c == EOF)
+      break;
+    if (c == '#') {
+      while (c != '\n' && c != EOF)
+        c = getc(fh);
+      continue;
     }
-    
-    /* Step. */
-    if (y < 7)
-      y++;
-    else
-      x++;
-    block[x + (y * 8)] = copy[++n];
-    
-    /* Up and right until limit. */
-    while (y > 0 && x < 7) {
-      y--;
-      x++;
-      block[x + (y * 8)] = copy[++n];
+    if (isspace(c))
+      continue;
+
+    ungetc(c, fh);
+    if (fscanf(fh, "%d", &value) != 1 || value < 0 || value > 65535) {
+      error(0, 0, "%s.%d: Invalid quantization value in %s",
+        __FILE__, __LINE__, name);
+      fclose(fh);
+      return -1;
+    }
+    if (n == 3 * 64) {
+      error(0, 0, "%s.%d: Too many quantization values in %s",
+        __FILE__, __LINE__, name);
+      fclose(fh);
+      return -1;
     }
+    tables[n / 64][n % 64] = value;
+    n++;
+  }
+  fclose(fh);
+
+  if (n == 64) {
+    /* One table for all components. */
+    memcpy(tables[1], tables[0], sizeof(tables[0]));
+    memcpy(tables[2], tables[0], sizeof(tables[0]));
+  } else if (n != 3 * 64) {
+    error(0, 0, "%s.%d: Expected 64 or 192 quantization values in %s",
+      __FILE__, __LINE__, name);
+    return -1;
   }
+
+  return 0;
 }
 
 
 
-/* IDCT function loosely based on Tom Lane's public domain function. */
-/* Note: Performance have been sacrificed for clarity. */
-void idct(int block[])
+void jpeg_free(jpeg_t *jpeg)
 {
-  int x, y, u, v;
-  double v_sum, u_sum;
-  int result[64];
-
-  for (x = 0; x < 8; x++) {
-    for (y = 0; y < 8; y++) {
-
-      v_sum = 0.0;
-      for (v = 0; v < 8; v++) {
-
-        u_sum = 0.0;
-        for (u = 0; u < 8; u++) {
-          u_sum += (double)block[v * 8 + u] * 0.5 *
-            (cos((double)((x + x + 1) * u) * (M_PI / 16.0)) / 
-            (double)((u == 0) ? sqrt(2.0) : 1.0));
-        }
-
-        v_sum += u_sum * 0.5 *
-          (cos((double)((y + y + 1) * v) * (M_PI / 16.0)) / 
-          (double)((v == 0) ? sqrt(2.0) : 1.0));
-      }
+  huffman_lut_free(jpeg->dc);
+  huffman_lut_free(jpeg->ac);
+  huffman_tree_free(jpeg->dc_tree);
+  huffman_tree_free(jpeg->ac_tree);
+}
+
+
+
+/* Positions for coefficients kept in zig-zag order. */
+static const int zig_zag_order[64] = {
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+  32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+  48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63,
+};
+
+/* Quantization for coefficients passed on as they are stored. */
+static const int no_quantization[64] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+#define DECODE_END   -1 /* Normal end of data, before a new block. */
+#define DECODE_ERROR -2
+
+
 
-      /* Round and store the result. */
-      result[y * 8 + x] = (int)(v_sum < 0.0)
-        ? - (0.5 - v_sum) : v_sum + 0.5;
+/* Decode the coefficients of one block. Each one is multiplied by the
+   quant[] entry for its zig-zag index, and written to coef[] at the
+   position given by order[] instead of being re-ordered afterwards. Only
+   non-zero coefficients are written, so coef[] must be zeroed before.
+   If zero_runs is not NULL, the number of zero coefficients before each
+   non-zero AC coefficient is counted there.
+   Returns the zig-zag index of the last non-zero coefficient, or one of
+   DECODE_END and DECODE_ERROR. */
+static inline int decode_block(jpeg_t *jpeg, int block_no, int coef[],
+  const int order[], const int quant[], long zero_runs[])
+{
+  int n, category, zeroes, diff, last;
+#ifdef JPEG_HUFFMAN_TREE
+  huffman_t *dc = jpeg->dc_tree, *ac = jpeg->ac_tree;
+#else
+  huffman_lut_t *dc = jpeg->dc, *ac = jpeg->ac;
+#endif
+
+  /* Decode DC coefficient. */
+  category = decode(&jpeg->reader, dc);
+  if (category == -1)
+    return DECODE_END; /* EOF here is normal, just read the last block. */
+
+  /* Note: Tests have shown that keeping the diff value for every fourth
+     component produces the bext results. (1:1:1:1 sub-sampling?) */
+  if (category > 0)
+    diff = extend(receive(&jpeg->reader, category), category);
+  else
+    diff = 0;
+  jpeg->prev_dc[block_no % 4] += diff;
+  coef[order[0]] = jpeg->prev_dc[block_no % 4] * quant[0];
+
+  /* Decode AC coefficients. */
+  n = 1;
+  last = 0;
+  while (n < 64) {
+    category = decode(&jpeg->reader, ac);
+    if (category == -1) {
+      error(0, 0, "%s.%d: Unexpected EOF.", __FILE__, __LINE__);
+      return DECODE_ERROR;
+    }
+    zeroes   = category >> 4;  /* High nibble. */
+    category = category & 0xF; /* Low nibble. */
+
+    if (category == 0) {
+      if (zeroes == 15)
+        n += 16;
+      else
+        break;
+
+    } else {
+      n += zeroes;
+      if (n >= 64) {
+        error(0, 0, "%s.%d: Buffer overflow.", __FILE__, __LINE__);
+        return DECODE_ERROR;
+      }
+      coef[order[n]] =
+        extend(receive(&jpeg->reader, category), category) * quant[n];
+      if (zero_runs != NULL)
+        zero_runs[n - last - 1]++;
+      last = n;
+      n++;
     }
   }
 
-  /* Update whole block with fresh results. */
-  /* Needs to be done afterwards, as block is in use during calculations. */
-  for (x = 0; x < 8; x++)
-    for (y = 0; y < 8; y++)
-      block[y * 8 + x] = result[y * 8 + x];
+  if (jpeg->reader.error) {
+    error(0, 0, "%s.%d: Unexpected EOF.", __FILE__, __LINE__);
+    return DECODE_ERROR;
+  }
+
+  return last;
 }
 
 
 
-static int quantization_component(int block_no)
+/* Decode picture data without the IDCT, passing each block of quantized
+   coefficients in zig-zag order to the callback. The coefficients are only
+   valid during the callback. Returns 0 on success, or -1 on error. */
+int jpeg_decode_coefficients(jpeg_t *jpeg, const unsigned char *data,
+  size_t size, jpeg_process_coefficients_t process_coefficients, void *sink)
 {
-  /* Note: Tests have shown that both luminance components can use the same
-     quantization, while the two chrominance components may require different
-     quantization for each one. */
-  switch (block_no % 4) {
-  case 0:
-  case 3:
-    return 0;
-  case 1:
-    return 1;
-  case 2:
-    return 2;
+  int i, block_no, last;
+  int coef[64] = {0}; /* Zeroed up to the last coefficient after each use. */
+
+  bit_reader_init(&jpeg->reader, data, size);
+  for (i = 0; i < 4; i++)
+    jpeg->prev_dc[i] = 0;
+
+  for (block_no = 0; ; block_no++) {
+    last = decode_block(jpeg, block_no, coef, zig_zag_order,
+      no_quantization, NULL);
+    if (last == DECODE_END)
+      break;
+    if (last == DECODE_ERROR)
+      return -1;
+
+    process_coefficients(sink, coef, block_no);
+
+    for (i = 0; i <= last; i++)
+      coef[i] = 0;
   }
+
   return 0;
 }
 
 
 
+/* Transform a block of dequantized coefficients in natural order to
+   8/scale x 8/scale samples. Positions up to the last non-zero coefficient
+   are cleared again, so coef[] can be reused for the next block. */
+static inline void transform_block(jpeg_t *jpeg, int coef[], int last,
+  int block[])
+{
+  int i, width, samples;
+
+  width = 8 / jpeg->scale; /* Samples in each row of the output block. */
+  samples = width * width;
+
+  /* Most blocks end early, so use the cheapest IDCT for the coefficients
+     present. Except for reduced blocks, these give the same result as the
+     full integer IDCT. */
+  if (jpeg->scale > 1) {
+    /* Only the top left coefficients are used for a reduced block. */
+    for (i = 0; i < width; i++)
+      memcpy(block + (i * width), coef + (i * 8), width * sizeof(int));
+    for (i = 0; i <= last; i++)
+      coef[jpeg_zig_zag_natural[i]] = 0;
+
+    switch (jpeg->scale) {
+    case 2:
+      idct_scaled_4x4(block);
+      break;
+    case 4:
+      idct_scaled_2x2(block);
+      break;
+    default:
+      idct_scaled_1x1(block);
+      break;
+    }
+
+  } else if (jpeg->idct == IDCT_FAST && last == 0) {
+    /* DC only, every sample in the block gets the same value. */
+    block[0] = coef[0];
+    coef[0] = 0;
+    idct_fast_dc(block);
+
+  } else if (jpeg->idct == IDCT_FAST && last <= ZIG_ZAG_LAST_4X4) {
+    /* Only the top left 4x4 coefficients are used. */
+    for (i = 0; i < 4; i++)
+      memcpy(block + (i * 8), coef + (i * 8), 4 * sizeof(int));
+    for (i = 0; i <= last; i++)
+      coef[jpeg_zig_zag_natural[i]] = 0;
+    idct_fast_4x4(block);
+
+  } else {
+    memcpy(block, coef, 64 * sizeof(int));
+    for (i = 0; i <= last; i++)
+      coef[jpeg_zig_zag_natural[i]] = 0;
+
+    /* Inverse Discrete Cosine Transform. */
+    switch (jpeg->idct) {
+    case IDCT_FAST:
+      simd_idct(block);
+      break;
+    case IDCT_FLOAT:
+      idct_float(block);
+      break;
+    case IDCT_REFERENCE:
+      idct_reference(block);
+      break;
+    }
+  }
+
+  /* Level shift. */
+  for (i = 0; i < samples; i++)
+    block[i] += 128;
+
+  /* Truncate out-of-range values created by IDCT. */
+  /* Note: Only seems to be needed with high quantization values. */
+  for (i = 0; i < samples; i++) {
+    if (block[i] < 0)
+      block[i] = 0;
+    if (block[i] > 255)
+      block[i] = 255;
+  }
+}
+
+
+
 /* JPEG decoder loosely based on information from the official JPEG standard.
    Note: This decoder is fine-tuned against its special application and will
    voilate some of the rules specified in the official standard. */
-/* next_byte() function should return 0-255 for a byte value or -1 on EOF.
+/* data should point to the picture data, after the 6 byte fake header.
    process_block() function assumes the caller understands what component
    is passed, based on the block number passed. */
-void jpeg_decode(int (next_byte(void)),
-  void (process_block(int block[], int block_no)), int yq, int cbq, int crq)
+/* Returns 0 on success, or -1 if the picture data is corrupt. */
+int jpeg_decode(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  jpeg_process_block_t process_block, void *sink)
 {
-  huffman_t *dc, *ac;
-  int i, n, category, zeroes, diff, block_no;
+  int i, block_no, last;
   int block[64];
-  int prev_dc[4] = {0,0,0,0};
+  int coef[64] = {0}; /* Zeroed up to the last coefficient after each use. */
+  stats_t *stats = jpeg->stats;
+  int64_t start = 0, now;
 
-  /* Note: Only lumiance huffman tables are used, even for chrominance. */
-  dc = huffman_convert_table(huffman_table_dc);
-  ac = huffman_convert_table(huffman_table_ac);
+  bit_reader_init(&jpeg->reader, data, size);
+  for (i = 0; i < 4; i++)
+    jpeg->prev_dc[i] = 0;
 
   /* Loop for each 8x8 block. (64 byte vector.) */
   block_no = 0;
   while (1) {
 
-    /* Decode DC coefficient. */
-    category = decode(next_byte, dc);
-    if (category == -1)
-      break; /* EOF here is normal, just read the last block. */
-
-    /* Note: Tests have shown that keeping the diff value for every fourth
-       component produces the bext results. (1:1:1:1 sub-sampling?) */
-    diff = receive(next_byte, category);
-    diff = extend(diff, category);
-    block[0] = prev_dc[block_no % 4] + diff;
-    prev_dc[block_no % 4] = block[0];
-
-    /* Decode AC coefficients. */
-    n = 1;
-    for (i = 1; i < 64; i++)
-      block[i] = 0;
-    while (n < 64) {
-      category = decode(next_byte, ac);
-      if (category == -1)
-        error(1, 0, "%s.%d: Unexpected EOF.", __FILE__, __LINE__);
-      zeroes   = category >> 4;  /* High nibble. */
-      category = category & 0xF; /* Low nibble. */
-
-      if (category == 0) {
-        if (zeroes == 15)
-          n += 16;
-        else
-          break;
-
-      } else {
-        n += zeroes;
-        if (n >= 64)
-          error(1, 0, "%s.%d: Buffer overflow.", __FILE__, __LINE__);
-        block[n] = receive(next_byte, category);
-        block[n] = extend(block[n], category);
-        n++;
-      }
-    }
+    /* Note: Coefficients are dequantized and written straight to their
+       natural (not zig-zag) positions, positions up to the last non-zero
+       one are cleared again when moved to the block. */
+    if (stats != NULL)
+      start = stats_clock();
+    last = decode_block(jpeg, block_no, coef, jpeg_zig_zag_natural,
+      jpeg->quant[quantization_component[block_no % 4]],
+      (stats != NULL) ? stats->zero_runs : NULL);
+    if (last == DECODE_END)
+      break;
+    if (last == DECODE_ERROR)
+      return -1;
 
-    /* Dequantize. */
-    for (i = 0; i < 64; i++) {
-      switch (quantization_component(block_no)) {
-      case 0:
-        block[i] *= yq;
-        break;
-      case 1:
-        block[i] *= cbq;
-        break;
-      case 2:
-        block[i] *= crq;
-        break;
-      }
+    if (stats != NULL) {
+      now = stats_clock();
+      stats->time[STATS_ENTROPY] += now - start;
+      start = now;
+      stats->blocks++;
+      stats->eob[last]++;
     }
 
-    /* Re-order vector back into 8x8 block from zig-zag ordering. */
-    /* Note: This needs to be done after quantization it seems. */
-    zig_zag_reorder(block);
-    
-    /* Inverse Discrete Cosine Transform. */
-    idct(block);
-
-    /* Level shift. */
-    for (i = 0; i < 64; i++)
-      block[i] += 128;
-
-    /* Truncate out-of-range values created by IDCT. */
-    /* Note: Only seems to be needed with high quantization values. */
-    for (i = 0; i < 64; i++) {
-      if (block[i] < 0)
-        block[i] = 0;
-      if (block[i] > 255)
-        block[i] = 255;
-    }
+    transform_block(jpeg, coef, last, block);
+
+    if (stats != NULL)
+      stats->time[STATS_IDCT] += stats_clock() - start;
 
     /* Pass block back to caller for processing. */
-    process_block(block, block_no);
+    process_block(sink, block, block_no);
 
     block_no++;
   }
 
-  huffman_tree_free(dc);
-  huffman_tree_free(ac);
+  if (stats != NULL)
+    stats->bits += (int64_t)jpeg->reader.pos * 8 - jpeg->reader.count;
+
+  return 0;
 }
 
+
+
+/* Entropy decode picture data once, keeping the quantized coefficients of
+   every block so the picture can be rendered with jpeg_render_blocks() for
+   several quantization settings. Stats are counted as by jpeg_decode(),
+   except for the IDCT. jpeg_blocks_free() must be called afterwards, even
+   on error. Returns 0 on success, or -1 if the picture data is corrupt. */
+int jpeg_decode_blocks(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  jpeg_blocks_t *blocks)
+{
+  int i, last;
+  stats_t *stats = jpeg->stats;
+  int64_t start = 0;
+
+  blocks->coef = NULL;
+  blocks->last = NULL;
+  blocks->count = 0;
+  blocks->allocated = 0;
+
+  bit_reader_init(&jpeg->reader, data, size);
+  for (i = 0; i < 4; i++)
+    jpeg->prev_dc[i] = 0;
+
+  if (stats != NULL)
+    start = stats_clock();
+
+  while (1) {
+    if (blocks->count == blocks->allocated) {
+      /* Room for a whole camera picture at first. */
+      blocks->allocated = (blocks->allocated == 0) ? 20 * 15 * 4 :
+        blocks->allocated * 2;
+      blocks->coef = realloc(blocks->coef,
+        sizeof(int [64]) * blocks->allocated);
+      blocks->last = realloc(blocks->last, sizeof(int) * blocks->allocated);
+      if (blocks->coef == NULL || blocks->last == NULL)
+        error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+    }
+
+    memset(blocks->coef[blocks->count], 0, sizeof(int [64]));
+    last = decode_block(jpeg, blocks->count, blocks->coef[blocks->count],
+      zig_zag_order, no_quantization,
+      (stats != NULL) ? stats->zero_runs : NULL);
+    if (last == DECODE_END)
+      break;
+    if (last == DECODE_ERROR)
+      return -1;
+
+    blocks->last[blocks->count++] = last;
+    if (stats != NULL)
+      stats->eob[last]++;
+  }
+
+  if (stats != NULL) {
+    stats->time[STATS_ENTROPY] += stats_clock() - start;
+    stats->blocks += blocks->count;
+    stats->bits += (int64_t)jpeg->reader.pos * 8 - jpeg->reader.count;
+  }
+
+  return 0;
+}
+
+
+
+/* Render blocks from jpeg_decode_blocks() with the quantization and IDCT
+   of the context, passing each one to the callback like jpeg_decode().
+   Several contexts can render the same blocks concurrently. */
+/* Note: Dequantization is counted as part of the IDCT stage here. */
+void jpeg_render_blocks(jpeg_t *jpeg, const jpeg_blocks_t *blocks,
+  jpeg_process_block_t process_block, void *sink)
+{
+  int i, block_no, last;
+  int block[64];
+  int coef[64] = {0}; /* Zeroed up to the last coefficient after each use. */
+  const int *quant;
+  stats_t *stats = jpeg->stats;
+  int64_t start = 0;
+
+  for (block_no = 0; block_no < blocks->count; block_no++) {
+    if (stats != NULL)
+      start = stats_clock();
+
+    quant = jpeg->quant[quantization_component[block_no % 4]];
+    last = blocks->last[block_no];
+    for (i = 0; i <= last; i++)
+      coef[jpeg_zig_zag_natural[i]] = blocks->coef[block_no][i] * quant[i];
+
+    transform_block(jpeg, coef, last, block);
+
+    if (stats != NULL)
+      stats->time[STATS_IDCT] += stats_clock() - start;
+
+    process_block(sink, block, block_no);
+  }
+}
+
+
+
+void jpeg_blocks_free(jpeg_blocks_t *blocks)
+{
+  free(blocks->coef);
+  free(blocks->last);
+}
+
+
+
+/* Encoding, the inverse of jpeg_decode_coefficients(). */
+
+
+
+/* Prepare an encoder context, data is collected in memory. */
+void jpeg_encoder_init(jpeg_encoder_t *encoder)
+{
+  int i;
+
+  encoder->dc = huffman_convert_codes(huffman_table_dc);
+  encoder->ac = huffman_convert_codes(huffman_table_ac);
+  encoder->data = NULL;
+  encoder->size = 0;
+  encoder->allocated = 0;
+  encoder->buffer = 0;
+  encoder->count = 0;
+  for (i = 0; i < 4; i++)
+    encoder->prev_dc[i] = 0;
+}
+
+
+
+static void put_byte(jpeg_encoder_t *encoder, unsigned char byte)
+{
+  if (encoder->size == encoder->allocated) {
+    encoder->allocated = (encoder->allocated == 0) ? 65536 :
+      encoder->allocated * 2;
+    encoder->data = realloc(encoder->data, encoder->allocated);
+    if (encoder->data == NULL)
+      error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+  }
+  encoder->data[encoder->size++] = byte;
+}
+
+
+
+/* Append bits to the stream, most significant first. */
+static void put_bits(jpeg_encoder_t *encoder, unsigned int bits, int count)
+{
+  unsigned char byte;
+
+  encoder->buffer = (encoder->buffer << count) | (bits & ((1U << count) - 1));
+  encoder->count += count;
+
+  while (encoder->count >= 8) {
+    byte = (encoder->buffer >> (encoder->count - 8)) & 0xFF;
+    put_byte(encoder, byte);
+    if (byte == 0xFF)
+      put_byte(encoder, 0x00); /* Stuffing, 0xFF would start a marker. */
+    encoder->count -= 8;
+  }
+}
+
+
+
+/* Category (number of bits) and bits for a value, the inverse of
+   extend(). */
+static int category_bits(int value, unsigned int *bits)
+{
+  int category, magnitude;
+
+  magnitude = (value < 0) ? -value : value;
+  for (category = 0; magnitude > 0; category++)
+    magnitude >>= 1;
+
+  *bits = (value < 0) ? value - 1 : value;
+  return category;
+}
+
+
+
+/* Encode a block of quantized coefficients in zig-zag order. The DC
+   coefficient is predicted from the previous block with the same
+   predictor, which is block_no % 4 for camera picture data. */
+/* Note: Values must be within the range of the tables, -1023 to 1023 for
+   AC coefficients and -2047 to 2047 for DC differences. */
+void jpeg_encode_block(jpeg_encoder_t *encoder, const int coef[],
+  int predictor)
+{
+  int n, run, category;
+  unsigned int bits;
+
+  category = category_bits(coef[0] - encoder->prev_dc[predictor], &bits);
+  encoder->prev_dc[predictor] = coef[0];
+  put_bits(encoder, encoder->dc->code[category],
+    encoder->dc->length[category]);
+  if (category > 0)
+    put_bits(encoder, bits, category);
+
+  run = 0;
+  for (n = 1; n < 64; n++) {
+    if (coef[n] == 0) {
+      run++;
+      continue;
+    }
+
+    while (run > 15) {
+      put_bits(encoder, encoder->ac->code[0xF0], encoder->ac->length[0xF0]);
+      run -= 16;
+    }
+
+    category = category_bits(coef[n], &bits);
+    put_bits(encoder, encoder->ac->code[(run << 4) | category],
+      encoder->ac->length[(run << 4) | category]);
+    put_bits(encoder, bits, category);
+    run = 0;
+  }
+
+  /* End of block. */
+  if (run > 0)
+    put_bits(encoder, encoder->ac->code[0x00], encoder->ac->length[0x00]);
+}
+
+
+
+/* Pad the last byte with one bits, as no code consists of only ones. */
+void jpeg_encoder_finish(jpeg_encoder_t *encoder)
+{
+  if (encoder->count > 0)
+    put_bits(encoder, 0x7F, 8 - encoder->count);
+}
+
+
+
+void jpeg_encoder_free(jpeg_encoder_t *encoder)
+{
+  huffman_codes_free(encoder->dc);
+  huffman_codes_free(encoder->ac);
+  free(encoder->data);
+}
+
+
+
+/* Camera pictures are 20 x 15 groups of Y1, Cb, Cr and Y2 blocks. */
+#define TRANSCODE_BLOCKS (20 * 15 * 4)
+
+/* Segments with the second luminance blocks are marked with this. */
+#define TRANSCODE_Y2_ID "Polaroid Y2"
+
+/* Largest segment data, the length field counts itself too. */
+#define TRANSCODE_SEGMENT_SIZE (65535 - 2)
+
+/* Transcoder state, passed to the coefficient callback. */
+typedef struct transcode_s {
+  jpeg_encoder_t scan; /* Y1, Cb and Cr blocks, in JFIF order. */
+  jpeg_encoder_t y2;   /* Second luminance blocks. */
+  int blocks;          /* Camera blocks added, including padding. */
+  int skipped;         /* Camera blocks beyond the full image. */
+} transcode_t;
+
+
+
+/* Used as process_coefficients() callback, with a transcode_t sink. */
+static void transcode_block(void *sink, int coef[], int block_no)
+{
+  transcode_t *transcode = sink;
+
+  if (block_no >= TRANSCODE_BLOCKS) {
+    transcode->skipped++; /* Picture data for more than the full image. */
+    return;
+  }
+
+  /* Note: Each component is predicted from its own previous block in the
+     camera data as well, so the DC differences are kept. */
+  if (block_no % 4 == 3)
+    jpeg_encode_block(&transcode->y2, coef, 0);
+  else
+    jpeg_encode_block(&transcode->scan, coef, block_no % 4);
+  transcode->blocks = block_no + 1;
+}
+
+
+
+static void put_segment(FILE *fh, int marker, const unsigned char *data,
+  size_t size)
+{
+  fputc(0xFF, fh);
+  fputc(marker, fh);
+  fputc((size + 2) >> 8, fh);
+  fputc((size + 2) & 0xFF, fh);
+  fwrite(data, sizeof(unsigned char), size, fh);
+}
+
+
+
+/* Write picture data as a baseline JFIF file, without decoding more than
+   the entropy coding. The image is 160x120, with the Y1, Cb and Cr blocks
+   of the camera as Y, Cb and Cr components sampled 1x1, and the
+   quantization tables of the decoder. The Y2 blocks do not fit a standard
+   JPEG image, so they are kept in APP9 segments, entropy coded the same
+   way as the scan. Missing blocks are written as zero.
+   Returns 0 on success, or -1 on error, without writing anything if the
+   picture data is corrupt. */
+int jpeg_transcode(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  FILE *fh)
+{
+  int i, j, result;
+  int zero[64] = {0};
+  size_t n, offset, id_size;
+  unsigned char *segment;
+  transcode_t transcode;
+
+  for (i = 0; i < 3; i++) {
+    for (j = 0; j < 64; j++) {
+      if (jpeg->quant[i][j] < 1 || jpeg->quant[i][j] > 255) {
+        error(0, 0, "%s.%d: Quantization values must be 1 to 255 for JPEG "
+          "output.", __FILE__, __LINE__);
+        return -1;
+      }
+    }
+  }
+
+  jpeg_encoder_init(&transcode.scan);
+  jpeg_encoder_init(&transcode.y2);
+  transcode.blocks = 0;
+  transcode.skipped = 0;
+
+  result = jpeg_decode_coefficients(jpeg, data, size, transcode_block,
+    &transcode);
+  if (result == -1) {
+    jpeg_encoder_free(&transcode.scan);
+    jpeg_encoder_free(&transcode.y2);
+    return -1;
+  }
+  if (transcode.skipped > 0)
+    error(0, 0, "%s.%d: Skipped %d blocks beyond the full image.",
+      __FILE__, __LINE__, transcode.skipped);
+  while (transcode.blocks < TRANSCODE_BLOCKS)
+    transcode_block(&transcode, zero, transcode.blocks);
+  jpeg_encoder_finish(&transcode.scan);
+  jpeg_encoder_finish(&transcode.y2);
+
+  /* Start of image, and the JFIF header with square pixels. */
+  fputc(0xFF, fh);
+  fputc(0xD8, fh);
+  put_segment(fh, 0xE0, (unsigned char *)"JFIF\0\x01\x01\0\0\x01\0\x01\0\0",
+    14);
+
+  /* The Y2 blocks, split to fit the segments. */
+  segment = malloc(TRANSCODE_SEGMENT_SIZE);
+  if (segment == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+  id_size = sizeof(TRANSCODE_Y2_ID);
+  memcpy(segment, TRANSCODE_Y2_ID, id_size);
+  for (offset = 0; offset < transcode.y2.size; offset += n) {
+    n = transcode.y2.size - offset;
+    if (n > TRANSCODE_SEGMENT_SIZE - id_size)
+      n = TRANSCODE_SEGMENT_SIZE - id_size;
+    memcpy(segment + id_size, transcode.y2.data + offset, n);
+    put_segment(fh, 0xE9, segment, id_size + n);
+  }
+
+  /* Quantization tables, in zig-zag order like the decoder's. */
+  for (i = 0; i < 3; i++) {
+    segment[i * 65] = i;
+    for (j = 0; j < 64; j++)
+      segment[(i * 65) + 1 + j] = jpeg->quant[i][j];
+  }
+  put_segment(fh, 0xDB, segment, 3 * 65);
+
+  /* Baseline frame, 8 bit samples, 120 lines of 160 samples and three
+     components with their own quantization tables. */
+  put_segment(fh, 0xC0, (unsigned char *)"\x08\0\x78\0\xA0\x03"
+    "\x01\x11\x00" "\x02\x11\x01" "\x03\x11\x02", 15);
+
+  /* Huffman tables, only the luminance ones are used, like the camera. */
+  segment[0] = 0x00;
+  memcpy(segment + 1, huffman_table_dc, sizeof(huffman_table_dc) - 1);
+  n = sizeof(huffman_table_dc);
+  segment[n] = 0x10;
+  memcpy(segment + n + 1, huffman_table_ac, sizeof(huffman_table_ac) - 1);
+  n += sizeof(huffman_table_ac);
+  put_segment(fh, 0xC4, segment, n);
+
+  /* Scan of all components with the same tables, and end of image. */
+  put_segment(fh, 0xDA, (unsigned char *)"\x03" "\x01\x00" "\x02\x00"
+    "\x03\x00" "\x00\x3F\x00", 10);
+  fwrite(transcode.scan.data, sizeof(unsigned char), transcode.scan.size,
+    fh);
+  fputc(0xFF, fh);
+  fputc(0xD9, fh);
+
+  free(segment);
+  jpeg_encoder_free(&transcode.scan);
+  jpeg_encoder_free(&transcode.y2);
+
+  if (ferror(fh))
+    result = -1;
+  return result;
+}
@@ -1,7 +1,86 @@
 #ifndef _JPEG_H
 #define _JPEG_H
 
-void jpeg_decode(int (next_byte(void)),
-  void (process_block(int block[], int block_no)), int yq, int cbq, int crq);
+#include "huffman.h"
+#include "idct.h"
+#include "stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> /* size_t */
+
+/* Bit reader state, bits are consumed from the top of the accumulator. */
+typedef struct jpeg_bit_reader_s {
+  const unsigned char *data; /* Input cursor. */
+  size_t size;
+  size_t pos;
+  uint64_t buffer;
+  int count; /* Number of valid bits in the buffer. */
+  int end;   /* Set when EOF or a marker has been reached. */
+  int error; /* Set when EOF was reached in the middle of a block. */
+} jpeg_bit_reader_t;
+
+/* Decoder context, one is needed for each picture decoded concurrently. */
+typedef struct jpeg_s {
+  jpeg_bit_reader_t reader;
+  int prev_dc[4];
+  huffman_lut_t *dc, *ac;
+  huffman_t *dc_tree, *ac_tree; /* Only built for the reference decoder. */
+  int quant[3][64]; /* Luminance, Cb and Cr, in zig-zag order. */
+  idct_method_t idct;
+  int scale; /* Blocks are output as 8/scale x 8/scale samples. */
+  stats_t *stats; /* Collected by jpeg_decode() if not NULL. */
+} jpeg_t;
+
+/* Encoder state, data is collected in memory. */
+typedef struct jpeg_encoder_s {
+  unsigned char *data;
+  size_t size;
+  size_t allocated;
+  uint32_t buffer;
+  int count; /* Number of bits in the buffer not yet written. */
+  int prev_dc[4];
+  huffman_codes_t *dc, *ac;
+} jpeg_encoder_t;
+
+/* Quantized coefficients of a whole picture, from jpeg_decode_blocks(). */
+typedef struct jpeg_blocks_s {
+  int (*coef)[64]; /* In zig-zag order. */
+  int *last;       /* Zig-zag index of the last non-zero coefficient. */
+  int count;
+  int allocated;
+} jpeg_blocks_t;
+
+/* Position in the 8x8 block for each coefficient in zig-zag order. */
+extern const int jpeg_zig_zag_natural[64];
+
+/* Called for each decoded block, with the sink passed to jpeg_decode().
+   The block holds 8/scale samples for each of 8/scale rows. */
+typedef void (*jpeg_process_block_t)(void *sink, int block[], int block_no);
+
+/* Called for each block of coefficients, in zig-zag order. */
+typedef void (*jpeg_process_coefficients_t)(void *sink, int coef[],
+  int block_no);
+
+void jpeg_init(jpeg_t *jpeg, int yq, int cbq, int crq, idct_method_t idct);
+void jpeg_set_scale(jpeg_t *jpeg, int scale);
+void jpeg_set_quantization(jpeg_t *jpeg, int tables[3][64]);
+int jpeg_read_quantization(const char *name, int tables[3][64]);
+void jpeg_free(jpeg_t *jpeg);
+int jpeg_decode(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  jpeg_process_block_t process_block, void *sink);
+int jpeg_decode_coefficients(jpeg_t *jpeg, const unsigned char *data,
+  size_t size, jpeg_process_coefficients_t process_coefficients, void *sink);
+int jpeg_decode_blocks(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  jpeg_blocks_t *blocks);
+void jpeg_render_blocks(jpeg_t *jpeg, const jpeg_blocks_t *blocks,
+  jpeg_process_block_t process_block, void *sink);
+void jpeg_blocks_free(jpeg_blocks_t *blocks);
+int jpeg_transcode(jpeg_t *jpeg, const unsigned char *data, size_t size,
+  FILE *fh);
+void jpeg_encoder_init(jpeg_encoder_t *encoder);
+void jpeg_encode_block(jpeg_encoder_t *encoder, const int coef[],
+  int predictor);
+void jpeg_encoder_finish(jpeg_encoder_t *encoder);
+void jpeg_encoder_free(jpeg_encoder_t *encoder);
 
 #endif /* _JPEG_H */
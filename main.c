@@ -1,6 +1,13 @@
 #include "comm.h"
+#include "convert.h"
 #include "jpeg.h"
-#include "pnm.h"
+#include "batch.h"
+#include "dump.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "simd.h"
+#include "stats.h"
+#include "sweep.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -9,49 +16,74 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <ctype.h>
+#include <limits.h>
 #include <arpa/inet.h> /* ntohs() */
 
 #define DEFAULT_DEVICE "/dev/ttyS0" /* Common first serial device in Linux. */
 
 
 
-typedef enum {
-  OUTPUT_NONE,
-  OUTPUT_COLOR,
-  OUTPUT_GREY,
-  OUTPUT_RAW,
-  OUTPUT_NODEC,
-  OUTPUT_ERASE,
-} output_type_t;
-
-
-
-/* Data shared between callback functions and the main loop. */
-static unsigned char *picture_data;
-static int picture_data_size;
-static int picture_data_count;
-static FILE *output_file;
-
-
-
 static void display_help(void)
 {
-  fprintf(stderr, "\nOptions:\n"
+  fprintf(stderr, "\nUsage: polaroid [OPTIONS]\n"
+    "       polaroid -f FILE [OPTIONS]\n"
+    "       polaroid -b [OPTIONS] FILE|DIRECTORY...\n"
+    "\nOptions:\n"
     "  -h          Display this help and exit.\n"
     "  -e          Erase/delete all pictures.\n"
     "  -d DEVICE   Use DEVICE instead of %s.\n"
+    "  -t MS       Milliseconds to wait for the camera, default is %d.\n"
+    "  -k          Do not verify checksums of picture data.\n"
+    "  -T FD       Write transfer telemetry to file descriptor FD, as one\n"
+    "              JSON object for each picture data frame and picture.\n"
+    "  -C DIR      Keep downloaded picture data in DIR, and only download\n"
+    "              pictures not already there.\n"
     "  -c          Color output (default) (PPM format).\n"
     "  -g          Greyscale output (luminance only) (PGM format).\n"
     "  -r          Raw component output (no quantization) (PGM format).\n"
-    "  -n          No JPEG decoding (dump raw picture data).\n\n",
-     DEFAULT_DEVICE);
+    "  -J          JPEG output, transcoded without loss to a 160x120 JFIF\n"
+    "              file. Only luminance block 1 is shown.\n"
+    "  -n          No JPEG decoding (dump raw picture data).\n"
+    "  -a          ASCII (plain) PPM/PGM output instead of binary.\n"
+    "  -i METHOD   IDCT method: fast (default), float or ref.\n"
+    "  -q FILE     Read quantization tables for color and greyscale output\n"
+    "              from FILE, one 8x8 table for all components, or one\n"
+    "              each for luminance, Cb and Cr.\n"
+    "  -Q SWEEP    Render color or greyscale output of a picture dump (-f)\n"
+    "              for each quantization setting in SWEEP, decoding it\n"
+    "              once. Settings are luminance, Cb and Cr values, like\n"
+    "              4,2,2:5,2,2, and ranges like 2-6,1-3,2 give every\n"
+    "              combination. Uses threads as set with -j.\n"
+    "  -z SCALE    Reduce output size by 2, 4 or 8, for fast previews.\n"
+    "  -D LEVEL    Despeckle, replace samples differing more than LEVEL\n"
+    "              (0-255) from the median of their neighbours.\n"
+    "  -U AMOUNT   Sharpen with an unsharp mask, AMOUNT in percent (1-500).\n"
+    "  -s KERNELS  SIMD kernels: auto (default), none, sse2 or avx2.\n"
+    "              Can also be set with the POLAROID_SIMD variable.\n"
+    "  -f FILE     Convert a picture dump (from -n) instead of using the\n"
+    "              camera. Output is written alongside the dump.\n"
+    "  -b          Batch convert picture dumps (from -n) instead of using\n"
+    "              the camera. Directories are searched for *.dat files,\n"
+    "              and output is written alongside each dump.\n"
+    "  -j THREADS  Number of batch (or sweep) threads, default is one for\n"
+    "              each CPU.\n"
+    "  -p          Pipelined download, pictures are converted on a separate\n"
+    "              thread while the next one is transferred.\n"
+    "  -S FILE     Write decoding statistics to FILE, as one JSON object\n"
+    "              for each picture and one for the whole run.\n\n",
+     DEFAULT_DEVICE, COMM_DEFAULT_TIMEOUT);
 }
 
 
 
+/* Camera information as printed, used to tell cameras apart in the cache. */
+static char camera_info[128];
+
+
+
 static int parse_camera_info(char *buffer, size_t buffer_size)
 {
-  int i;
+  int i, n;
 
   if (buffer_size != 14)
     error(1, 0, "%s.%d: Invalid camera info buffer size: %d",
@@ -61,14 +93,16 @@ static int parse_camera_info(char *buffer, size_t buffer_size)
     error(0, 0, "%s.%d: Wrong camera info header: 0x%02X",
       __FILE__, __LINE__, buffer[0]);
 
-  printf("Camera information: ");
+  n = 0;
   for (i = 1; i < buffer_size; i++) {
     if (isprint(buffer[i]))
-      printf("%c", buffer[i]);
+      n += snprintf(camera_info + n, sizeof(camera_info) - n, "%c",
+        buffer[i]);
     else
-      printf(" (0x%02X)", (unsigned char)buffer[i]);
+      n += snprintf(camera_info + n, sizeof(camera_info) - n, " (0x%02X)",
+        (unsigned char)buffer[i]);
   }
-  printf("\n");
+  printf("Camera information: %s\n", camera_info);
 
   return 0;
 }
@@ -132,56 +166,40 @@ static int parse_picture_size(char *buffer, size_t buffer_size)
 
 
 
-static int read_picture_data(void)
-{
-  if (picture_data_count >= picture_data_size)
-    return EOF;
-  else
-    return *(picture_data + picture_data_count++);
-}
-
-
-
-/* Open a new file without overwriting an old one. */
-static FILE *open_exclusive_file(int picture_no, char *extension)
-{
-  int try;
-  char name[32];
-  FILE *fh;
-
-  for (try = 0; ; try++) {
-    if (try == 0)
-      snprintf(name, sizeof(name), "polaroid.%02d.%s",
-        picture_no, extension);
-    else
-      snprintf(name, sizeof(name), "polaroid.%02d.%s.%d",
-        picture_no, extension, try);
-
-    /* Note: 'x' is a GNU C library extension. */
-    fh = fopen(name, "wx");
-    if (fh == NULL) {
-      if (errno != EEXIST)
-        error(1, errno, "%s.%d: fopen()", __FILE__, __LINE__);
-    } else
-      break; /* Opened an exclusive file. */
-
-    /* File already exists, try another one. */
-  }
-  
-  return fh;
-}
-
-
-
 int main(int argc, char *argv[])
 {
-  int i, j, c, tty, no_of_pictures;
+  int i, c, tty, no_of_pictures;
+  int picture_data_size;
+  unsigned char *picture_data;
+  char base[32];
   struct termios tty_settings;
   char *device = NULL;
-  char *component_ext[4] = {"y1.pgm", "cb.pgm", "cr.pgm", "y2.pgm"};
-  output_type_t output_type = OUTPUT_NONE;
-
-  while ((c = getopt(argc, argv, "hed:cgrn")) != -1) {
+  convert_options_t options;
+  int batch = 0, threads = 0, pipelined = 0, telemetry_fd, result;
+  pipeline_t *pipeline = NULL;
+  comm_stats_t stats;
+  char *cache_directory = NULL;
+  cache_t cache;
+  char *input = NULL;
+  char input_base[PATH_MAX];
+  dump_t dump;
+  simd_t simd = SIMD_AUTO;
+  int quantization[3][64];
+  char *stats_name = NULL;
+  stats_t picture_stats, *picture_stats_p;
+  int64_t transfer_start;
+  sweep_t sweep = {NULL, 0};
+
+  options.output_type = OUTPUT_NONE;
+  options.idct = IDCT_FAST;
+  options.ascii = 0;
+  options.quantization = NULL;
+  options.scale = 1;
+  options.despeckle = -1;
+  options.sharpen = 0;
+
+  while ((c = getopt(argc, argv,
+    "hed:t:kT:C:cgrJnai:q:Q:z:D:U:s:f:bj:pS:")) != -1) {
     switch (c) {
     case 'h':
       display_help();
@@ -191,26 +209,124 @@ int main(int argc, char *argv[])
       device = optarg;
       break;
 
+    case 't':
+      if (atoi(optarg) < 1)
+        error(1, 0, "%s.%d: Invalid timeout: %s", __FILE__, __LINE__, optarg);
+      comm_set_timeout(atoi(optarg));
+      break;
+
+    case 'k':
+      comm_set_verify(0);
+      break;
+
+    case 'T':
+      telemetry_fd = atoi(optarg);
+      if (fcntl(telemetry_fd, F_GETFD) == -1)
+        error(1, errno, "%s.%d: Invalid file descriptor: %s",
+          __FILE__, __LINE__, optarg);
+      comm_set_telemetry(telemetry_fd);
+      break;
+
+    case 'C':
+      cache_directory = optarg;
+      break;
+
+    case 'i':
+      if (idct_method_parse(optarg, &options.idct) == -1)
+        error(1, 0, "%s.%d: Unknown IDCT method: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 'q':
+      if (jpeg_read_quantization(optarg, quantization) == -1)
+        exit(1);
+      options.quantization = quantization;
+      break;
+
+    case 'Q':
+      sweep_free(&sweep);
+      if (sweep_parse(optarg, &sweep) == -1)
+        exit(1);
+      break;
+
+    case 'z':
+      options.scale = atoi(optarg);
+      if (options.scale != 1 && options.scale != 2 && options.scale != 4 &&
+        options.scale != 8)
+        error(1, 0, "%s.%d: Invalid scale: %s", __FILE__, __LINE__, optarg);
+      break;
+
+    case 'a':
+      options.ascii = 1;
+      break;
+
+    case 'f':
+      input = optarg;
+      break;
+
+    case 'b':
+      batch = 1;
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 1)
+        error(1, 0, "%s.%d: Invalid number of threads: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 'p':
+      pipelined = 1;
+      break;
+
+    case 'D':
+      options.despeckle = atoi(optarg);
+      if (options.despeckle < 0 || options.despeckle > 255)
+        error(1, 0, "%s.%d: Invalid despeckle level: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 'U':
+      options.sharpen = atoi(optarg);
+      if (options.sharpen < 1 || options.sharpen > 500)
+        error(1, 0, "%s.%d: Invalid sharpen amount: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
+    case 'S':
+      stats_name = optarg;
+      break;
+
+    case 's':
+      if (simd_parse(optarg, &simd) == -1)
+        error(1, 0, "%s.%d: Unknown SIMD kernels: %s",
+          __FILE__, __LINE__, optarg);
+      break;
+
     case 'c':
     case 'g':
     case 'r':
+    case 'J':
     case 'n':
     case 'e':
-      if (output_type != OUTPUT_NONE) {
+      if (options.output_type != OUTPUT_NONE) {
         error(1, 0,
-          "%s.%d: Only one of the options -c, -g, -r, -n or -e can be set.",
+          "%s.%d: Only one of the options -c, -g, -r, -J, -n or -e can be "
+          "set.",
           __FILE__, __LINE__);
       } else {
         if (c == 'c')
-          output_type = OUTPUT_COLOR;
+          options.output_type = OUTPUT_COLOR;
         else if (c == 'g')
-          output_type = OUTPUT_GREY;
+          options.output_type = OUTPUT_GREY;
         else if (c == 'r')
-          output_type = OUTPUT_RAW;
+          options.output_type = OUTPUT_RAW;
+        else if (c == 'J')
+          options.output_type = OUTPUT_JPEG;
         else if (c == 'n')
-          output_type = OUTPUT_NODEC;
+          options.output_type = OUTPUT_NODEC;
         else if (c == 'e')
-          output_type = OUTPUT_ERASE;
+          options.output_type = OUTPUT_ERASE;
       }
       break;
 
@@ -221,11 +337,68 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (output_type == OUTPUT_NONE)
-    output_type = OUTPUT_COLOR; /* The default choice. */
+  if (options.output_type == OUTPUT_NONE)
+    options.output_type = OUTPUT_COLOR; /* The default choice. */
 
   if (device == NULL)
     device = DEFAULT_DEVICE;
+
+  simd_init(simd);
+
+  if (stats_name != NULL && stats_open(stats_name) == -1)
+    return 1;
+  picture_stats_p = (stats_enabled()) ? &picture_stats : NULL;
+
+  if (batch || input != NULL) {
+    if (batch && input != NULL)
+      error(1, 0, "%s.%d: Only one of the options -b or -f can be set.",
+        __FILE__, __LINE__);
+    if (pipelined)
+      error(1, 0, "%s.%d: Option -p needs a camera.", __FILE__, __LINE__);
+    if (options.output_type == OUTPUT_NODEC ||
+        options.output_type == OUTPUT_ERASE)
+      error(1, 0, "%s.%d: Options -n and -e need a camera.",
+        __FILE__, __LINE__);
+  }
+
+  if (sweep.count > 0) {
+    if (input == NULL)
+      error(1, 0, "%s.%d: Option -Q needs -f.", __FILE__, __LINE__);
+    if (options.output_type != OUTPUT_COLOR &&
+        options.output_type != OUTPUT_GREY)
+      error(1, 0, "%s.%d: Option -Q needs color or greyscale output.",
+        __FILE__, __LINE__);
+    if (options.quantization != NULL)
+      error(1, 0, "%s.%d: Only one of the options -q or -Q can be set.",
+        __FILE__, __LINE__);
+  }
+
+  if (input != NULL) {
+    if (dump_map(input, &dump) == -1)
+      return 1;
+    dump_base_name(input, input_base, sizeof(input_base));
+    stats_init(&picture_stats);
+    if (sweep.count > 0)
+      result = sweep_picture(dump.data, dump.size, &options, input_base,
+        &sweep, threads);
+    else {
+      result = convert_picture(dump.data, dump.size, &options, input_base,
+        picture_stats_p);
+      if (result == 0)
+        stats_report(&picture_stats, input_base);
+    }
+    dump_unmap(&dump);
+    stats_close();
+    return (result == -1) ? 1 : 0;
+  }
+
+  if (batch) {
+    if (optind >= argc)
+      error(1, 0, "%s.%d: No files to convert.", __FILE__, __LINE__);
+    result = batch_convert(&argv[optind], argc - optind, threads, &options);
+    stats_close();
+    return (result > 0) ? 1 : 0;
+  }
       
   tty = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
   if (tty == -1)
@@ -242,79 +415,87 @@ int main(int argc, char *argv[])
     error(1, errno, "%s.%d: tcsetattr()", __FILE__, __LINE__);
 
   /* Initialize camera. */
-  comm_command(tty, 0x00, 0, NULL);
-  comm_command(tty, 0x01, 0, parse_camera_info);
-  comm_command(tty, 0x02, 0, parse_camera_state);
-  comm_command(tty, 0x0A, 0, NULL);
+  comm_command(tty, 0x00, 0, 0, NULL);
+  comm_command(tty, 0x01, 0, 14, parse_camera_info);
+  comm_command(tty, 0x02, 0, 24, parse_camera_state);
+  comm_command(tty, 0x0A, 0, 0, NULL);
 
-  if (output_type == OUTPUT_ERASE) {
-    comm_command(tty, 0x07, 0, NULL); /* Delete all pictures. */
+  if (options.output_type == OUTPUT_ERASE) {
+    comm_command(tty, 0x07, 0, 0, NULL); /* Delete all pictures. */
     printf("--- ALL PICTURES ERASED ---\n");
     close(tty);
     return 0;
   }
 
+  if (cache_directory != NULL &&
+    cache_open(&cache, cache_directory, camera_info) == -1)
+    return 1;
+
   /* Get amount of pictures and loop for each picture. */
-  no_of_pictures = comm_command(tty, 0x03, 0, parse_no_of_pictures);
+  no_of_pictures = comm_command(tty, 0x03, 0, 0, parse_no_of_pictures);
   printf("----------------------------------------"
          "----------------------------------------\n");
+  if (pipelined)
+    pipeline = pipeline_start(&options);
   for (i = 1; i <= no_of_pictures; i++) {
-    picture_data_size = comm_command(tty, 0x04, i, parse_picture_size);
-    picture_data = (unsigned char *)malloc(sizeof(unsigned char) *
-      picture_data_size);
-
-    /* Skip 6 first bytes when starting the read. */
-    /* This is some fake header, and not valid JPEG data. */
-    picture_data_count = 6;
-
-    comm_get_picture_data(tty, i, picture_data_size, picture_data);
-
-    switch (output_type) {
-    case OUTPUT_COLOR:
-      output_file = open_exclusive_file(i, "ppm");
-      /* PPM header, dimensions and max-val. */
-      pnm_init(output_file, 0, "P3\n320 240\n255\n");
-      /* Quantization value 4 for luminance and 2 for each chrominace
-         component seems to produce the best overall result for all pictures.
-         Note: The colors will be a bit pale. */
-      jpeg_decode(read_picture_data, pnm_block_to_ppm, 4, 2, 2);
-      break;
-
-    case OUTPUT_GREY:
-      output_file = open_exclusive_file(i, "pgm");
-      /* PGM header, dimensions and max-val. */
-      pnm_init(output_file, 0, "P2\n160 120\n255\n");
-      /* Lumiance quantzation of 4 seems to be about right. */
-      jpeg_decode(read_picture_data, pnm_component_to_pgm, 4, 0, 0);
-      break;
-
-    case OUTPUT_RAW:
-      for (j = 0; j < 4; j++) {
-        picture_data_count = 6; /* Need to reset for each round... */
-        output_file = open_exclusive_file(i, component_ext[j]);
-        pnm_init(output_file, j, "P2\n160 120\n255\n");
-        /* No quantization for the components, needs to be handled by
-           an external tool later. */
-        jpeg_decode(read_picture_data, pnm_component_to_pgm, 1, 1, 1);
-        if (j < 3)
-          fclose(output_file);
-      }
-      break;
-
-    case OUTPUT_NODEC:
-      output_file = open_exclusive_file(i, "dat");
-      fwrite(picture_data, sizeof(char), picture_data_size, output_file);
-      break;
+    picture_data_size = comm_command(tty, 0x04, i, 7,
+      parse_picture_size);
+    picture_data = NULL;
+    stats_init(&picture_stats);
+    if (cache_directory != NULL)
+      picture_data = cache_lookup(&cache, i, picture_data_size);
+
+    if (picture_data != NULL)
+      printf("Picture %d found in cache.\n", i);
+    else {
+      picture_data = (unsigned char *)malloc(sizeof(unsigned char) *
+        picture_data_size);
+
+      transfer_start = stats_clock();
+      comm_get_picture_data(tty, i, picture_data_size, picture_data);
+      picture_stats.time[STATS_TRANSFER] = stats_clock() - transfer_start;
+
+      if (cache_directory != NULL)
+        cache_store(&cache, i, picture_data, picture_data_size);
+    }
 
-    default:
-      break;
+    if (pipelined) {
+      /* Converted and freed by the pipeline worker. */
+      pipeline_put(pipeline, picture_data, picture_data_size, i,
+        picture_stats_p);
+      continue;
     }
 
-    fclose(output_file);
+    snprintf(base, sizeof(base), "polaroid.%02d", i);
+    if (convert_picture(picture_data, picture_data_size, &options,
+      base, picture_stats_p) == -1)
+      error(1, 0, "%s.%d: Conversion of picture %d failed.",
+        __FILE__, __LINE__, i);
+    stats_report(&picture_stats, base);
+
     free(picture_data);
   }
 
   close(tty);
-  return 0;
+
+  if (cache_directory != NULL)
+    cache_close(&cache);
+
+  comm_finish_telemetry();
+  comm_get_stats(&stats);
+  if (stats.pictures > 0 && stats.transfer_ns > 0)
+    printf("Transfer statistics: %ld bytes in %.1f s (%.1f kB/s), "
+      "%.0f%% waiting, %ld stalls.\n", stats.bytes, stats.transfer_ns / 1e9,
+      stats.bytes * 1e6 / stats.transfer_ns,
+      stats.wait_ns * 100.0 / stats.transfer_ns, stats.stalls);
+  if (stats.checksum_errors > 0)
+    printf("Transfer statistics: %ld frames, %ld checksum errors, "
+      "%ld retries.\n", stats.frames, stats.checksum_errors, stats.retries);
+
+  result = 0;
+  if (pipelined && pipeline_finish(pipeline) > 0)
+    result = 1;
+  stats_close();
+  return result;
 }
 
@@ -0,0 +1,157 @@
+#include "pipeline.h"
+#include "convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <error.h>
+#include <pthread.h>
+
+/* Conversion of downloaded pictures on a worker thread, so the decoding
+   and writing of one picture overlaps the transfer of the next. */
+
+
+
+/* Pictures downloaded but not yet converted. Limited, so a slow disk can
+   not make the downloaded pictures pile up in memory. */
+#define PIPELINE_DEPTH 4
+
+typedef struct pipeline_picture_s {
+  unsigned char *data;
+  size_t size;
+  int picture_no;
+  stats_t stats;
+  int has_stats;
+} pipeline_picture_t;
+
+struct pipeline_s {
+  pipeline_picture_t queue[PIPELINE_DEPTH];
+  int first; /* Index of the oldest picture in the queue. */
+  int count;
+  int done;  /* Set when no more pictures will be added. */
+  int failed;
+  const convert_options_t *options;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_t worker;
+};
+
+
+
+static void *pipeline_worker(void *arg)
+{
+  pipeline_t *pipeline = arg;
+  pipeline_picture_t picture;
+  char base[32];
+
+  while (1) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->count == 0 && ! pipeline->done)
+      pthread_cond_wait(&pipeline->not_empty, &pipeline->lock);
+    if (pipeline->count == 0) {
+      pthread_mutex_unlock(&pipeline->lock);
+      break; /* Done, and nothing left in the queue. */
+    }
+    picture = pipeline->queue[pipeline->first];
+    pipeline->first = (pipeline->first + 1) % PIPELINE_DEPTH;
+    pipeline->count--;
+    pthread_cond_signal(&pipeline->not_full);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    snprintf(base, sizeof(base), "polaroid.%02d", picture.picture_no);
+    if (convert_picture(picture.data, picture.size, pipeline->options,
+      base, (picture.has_stats) ? &picture.stats : NULL) == -1) {
+      error(0, 0, "%s.%d: Conversion of picture %d failed.",
+        __FILE__, __LINE__, picture.picture_no);
+      pthread_mutex_lock(&pipeline->lock);
+      pipeline->failed++;
+      pthread_mutex_unlock(&pipeline->lock);
+    } else if (picture.has_stats)
+      stats_report(&picture.stats, base);
+
+    free(picture.data);
+  }
+
+  return NULL;
+}
+
+
+
+/* Start the worker thread, which converts pictures as they are added. */
+pipeline_t *pipeline_start(const convert_options_t *options)
+{
+  int result;
+  pipeline_t *pipeline;
+
+  pipeline = malloc(sizeof(pipeline_t));
+  if (pipeline == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  pipeline->first = 0;
+  pipeline->count = 0;
+  pipeline->done = 0;
+  pipeline->failed = 0;
+  pipeline->options = options;
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->not_empty, NULL);
+  pthread_cond_init(&pipeline->not_full, NULL);
+
+  result = pthread_create(&pipeline->worker, NULL, pipeline_worker,
+    pipeline);
+  if (result != 0)
+    error(1, result, "%s.%d: pthread_create()", __FILE__, __LINE__);
+
+  return pipeline;
+}
+
+
+
+/* Queue a downloaded picture for conversion, waiting if the queue is full.
+   The picture data is freed by the worker when it has been converted.
+   Stats, like the transfer time, are copied and completed by the worker
+   unless NULL. */
+void pipeline_put(pipeline_t *pipeline, unsigned char *picture_data,
+  size_t size, int picture_no, const stats_t *stats)
+{
+  pipeline_picture_t *picture;
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->count == PIPELINE_DEPTH)
+    pthread_cond_wait(&pipeline->not_full, &pipeline->lock);
+
+  picture = &pipeline->queue[(pipeline->first + pipeline->count) %
+    PIPELINE_DEPTH];
+  picture->data = picture_data;
+  picture->size = size;
+  picture->picture_no = picture_no;
+  picture->has_stats = (stats != NULL);
+  if (stats != NULL)
+    picture->stats = *stats;
+  pipeline->count++;
+
+  pthread_cond_signal(&pipeline->not_empty);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+
+
+/* Wait for the queued pictures to be converted, and stop the worker.
+   Returns the number of pictures that failed. */
+int pipeline_finish(pipeline_t *pipeline)
+{
+  int failed;
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->done = 1;
+  pthread_cond_signal(&pipeline->not_empty);
+  pthread_mutex_unlock(&pipeline->lock);
+
+  pthread_join(pipeline->worker, NULL);
+
+  failed = pipeline->failed;
+  pthread_cond_destroy(&pipeline->not_empty);
+  pthread_cond_destroy(&pipeline->not_full);
+  pthread_mutex_destroy(&pipeline->lock);
+  free(pipeline);
+
+  return failed;
+}
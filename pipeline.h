@@ -0,0 +1,15 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "convert.h"
+#include "stats.h"
+#include <stdlib.h> /* size_t */
+
+typedef struct pipeline_s pipeline_t;
+
+pipeline_t *pipeline_start(const convert_options_t *options);
+void pipeline_put(pipeline_t *pipeline, unsigned char *picture_data,
+  size_t size, int picture_no, const stats_t *stats);
+int pipeline_finish(pipeline_t *pipeline);
+
+#endif /* _PIPELINE_H */
@@ -1,117 +1,281 @@
+#include "pnm.h"
+#include "simd.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
 
 /* Portable aNyMap functions. */
 
+/* The image is written as binary (P6/P5) or ASCII (P3/P2) format while
+   decoding, one stripe of blocks at a time, so only a single band of
+   scanlines is kept in memory. */
 
 
-/* 4 components, 20 blocks in width, 64 values per block. */ 
-/* Actually just 3 components, but luminance has double sampling. */
-static int saved_block[4][20][64];
-static int saved_block_no = 0;
 
-/* Parameters for converters. */
-static int selected_component;
-static FILE *output_file;
+/* Write scanlines to the output file. */
+static void write_rows(pnm_t *pnm, const unsigned char *data, int rows)
+{
+  int i, n, size, row_size;
+  int64_t start = 0;
 
+  row_size = pnm->width * pnm->channels;
+  size = row_size * rows;
+  if (pnm->stats != NULL)
+    start = stats_clock();
 
+  if (pnm->ascii) {
+    if (pnm->channels == 3) {
+      /* One line for each 16 pixels wide block, or what is left of a
+         row for reduced sizes. */
+      for (i = 0; i < size; i += row_size) {
+        for (n = 0; n < row_size; n += 3) {
+          fprintf(pnm->output_file, "%d %d %d ", data[i + n],
+            data[i + n + 1], data[i + n + 2]);
+          if (n % 48 == 45 || n + 3 == row_size)
+            fprintf(pnm->output_file, "\n");
+        }
+      }
+    } else {
+      /* One line for each row. */
+      for (i = 0; i < size; i += row_size) {
+        for (n = 0; n < pnm->width; n++)
+          fprintf(pnm->output_file, "%d ", data[i + n]);
+        fprintf(pnm->output_file, "\n");
+      }
+    }
+
+  } else {
+    fwrite(data, sizeof(unsigned char), size, pnm->output_file);
+  }
 
-static void print_rgb(double y, double cb, double cr)
+  if (pnm->stats != NULL)
+    pnm->stats->time[STATS_OUTPUT] += stats_clock() - start;
+}
+
+
+
+/* Used as emit() callback for the filter, with a pnm_t sink. */
+static void collect_row(void *sink, const unsigned char *row)
 {
-  int red, green, blue;
-
-  /* Convert from YCbCr to RGB. */
-  red   = (int)(y                          + 1.402   * (cr - 128.0));
-  green = (int)(y - 0.34414 * (cb - 128.0) - 0.71414 * (cr - 128.0));
-  blue  = (int)(y + 1.772   * (cb - 128.0));
-
-  /* Cut values if they are out of range. */
-  if (red > 255)
-    red = 255;
-  else if (red < 0)
-    red = 0;
-
-  if (green > 255)
-    green = 255;
-  else if (green < 0)
-    green = 0;
-
-  if (blue > 255)
-    blue = 255;
-  else if (blue < 0)
-    blue = 0;
-
-  fprintf(output_file, "%d %d %d ", red, green, blue);
+  pnm_t *pnm = sink;
+  int size = pnm->width * pnm->channels;
+
+  memcpy(pnm->filtered + pnm->filtered_rows * size, row, size);
+  pnm->filtered_rows++;
 }
 
 
 
-void pnm_block_to_ppm(int block[], int block_no)
+/* Write finished scanlines from the band to the output file, through the
+   filter if there is one. */
+static void write_band(pnm_t *pnm, int rows)
 {
-  int i, row, col, y1, y2;
+  int i, size;
+  int64_t start = 0;
+
+  if (pnm->filter == NULL) {
+    write_rows(pnm, pnm->band, rows);
+  } else {
+    if (pnm->stats != NULL)
+      start = stats_clock();
 
-  for (i = 0; i < 64; i++)
-    saved_block[block_no % 4][saved_block_no][i] = block[i];
+    size = pnm->width * pnm->channels;
+    pnm->filtered_rows = 0;
+    for (i = 0; i < rows; i++)
+      filter_push(pnm->filter, pnm->band + i * size, collect_row, pnm);
+
+    if (pnm->stats != NULL)
+      pnm->stats->time[STATS_FILTER] += stats_clock() - start;
+    write_rows(pnm, pnm->filtered, pnm->filtered_rows);
+  }
+
+  pnm->rows_written += rows;
+}
+
+
+
+/* Used as process_block() callback for jpeg_decode(), with a pnm_t sink. */
+void pnm_block_to_ppm(void *sink, int block[], int block_no)
+{
+  pnm_t *pnm = sink;
+  int i, n, row, col, y1, y2, offset, size, width;
+  int y[320], cb[160], cr[160];
+  int64_t start = 0;
+
+  size = pnm->block_size;
+  width = pnm->width;
+
+  for (i = 0; i < size * size; i++)
+    pnm->saved_block[block_no % 4][pnm->saved_block_no][i] = block[i];
 
   if (block_no % 4 == 3)
-    saved_block_no++;
+    pnm->saved_block_no++;
+
+  /* Entire image width collected, time to write the scanlines. */
+  if (pnm->saved_block_no >= 20) {
+    pnm->saved_block_no = 0;
+    if (pnm->rows_written >= pnm->height)
+      return; /* Picture data for more than the full image, skip. */
+
+    if (pnm->stats != NULL)
+      start = stats_clock();
 
-  if (saved_block_no >= 20) { /* Entire image width collected, time to dump. */
-    saved_block_no = 0;
+    for (row = 0; row < size * 2; row++) { /* Rows */
 
-    for (row = 0; row < 16; row++) {   /* Rows */
+      /* Show the two luminance components as a chess-board combination. */
+      y1 = (row % 2 == 0) ? 0 : 3;
+      y2 = (row % 2 == 0) ? 3 : 0;
+
+      /* Collect the whole row, then convert it from YCbCr to RGB straight
+         into the band. Both luminance samples share the chrominance. */
+      n = 0;
       for (col = 0; col < 20; col++) { /* Columns */
-        for (i = 0; i < 8; i++) {      /* Values */
-
-          /* Show the two luminance components as a chess-board combination. */
-          y1 = (row % 2 == 0) ? 0 : 3;
-          y2 = (row % 2 == 0) ? 3 : 0;
-          
-          print_rgb((double)saved_block[y1][col][((row / 2) * 8) + i],
-                    (double)saved_block[1][col][((row / 2) * 8) + i],
-                    (double)saved_block[2][col][((row / 2) * 8) + i]);
-
-          print_rgb((double)saved_block[y2][col][((row / 2) * 8) + i],
-                    (double)saved_block[1][col][((row / 2) * 8) + i],
-                    (double)saved_block[2][col][((row / 2) * 8) + i]);
+        for (i = 0; i < size; i++) {   /* Values */
+          offset = ((row / 2) * size) + i;
+          y[n * 2]     = pnm->saved_block[y1][col][offset];
+          y[n * 2 + 1] = pnm->saved_block[y2][col][offset];
+          cb[n]        = pnm->saved_block[1][col][offset];
+          cr[n]        = pnm->saved_block[2][col][offset];
+          n++;
         }
-        fprintf(output_file, "\n");
       }
+      simd_ycc_to_rgb(y, cb, cr, pnm->band + row * width * 3, width);
     }
+
+    if (pnm->stats != NULL)
+      pnm->stats->time[STATS_COLOR] += stats_clock() - start;
+    write_band(pnm, size * 2);
   }
 }
 
 
 
-void pnm_component_to_pgm(int block[], int block_no)
+/* Used as process_block() callback for jpeg_decode(), with a pnm_t sink. */
+void pnm_component_to_pgm(void *sink, int block[], int block_no)
 {
-  int i, row, col;
+  pnm_t *pnm = sink;
+  int i, row, col, size;
+  unsigned char *line;
 
-  if (block_no % 4 == selected_component) {
-    for (i = 0; i < 64; i++)
-      saved_block[0][saved_block_no][i] = block[i];
-    saved_block_no++;
+  size = pnm->block_size;
+
+  if (block_no % 4 == pnm->selected_component) {
+    for (i = 0; i < size * size; i++)
+      pnm->saved_block[0][pnm->saved_block_no][i] = block[i];
+    pnm->saved_block_no++;
   }
 
-  if (saved_block_no >= 20) { /* Entire image width collected, time to dump. */
-    saved_block_no = 0;
-    for (row = 0; row < 8; row++) {    /* Rows */
+  /* Entire image width collected, time to write the scanlines. */
+  if (pnm->saved_block_no >= 20) {
+    pnm->saved_block_no = 0;
+    if (pnm->rows_written >= pnm->height)
+      return; /* Picture data for more than the full image, skip. */
+
+    for (row = 0; row < size; row++) { /* Rows */
+      line = pnm->band + row * pnm->width;
       for (col = 0; col < 20; col++) { /* Columns */
-        for (i = 0; i < 8; i++) {      /* Values */
-          fprintf(output_file, "%d ", saved_block[0][col][(row * 8) + i]);
+        for (i = 0; i < size; i++) {   /* Values */
+          line[(col * size) + i] = pnm->saved_block[0][col][(row * size) + i];
         }
       }
-      fprintf(output_file, "\n");
     }
+    write_band(pnm, size);
   }
 }
 
 
 
 /* Note: This must be run before using one of the converters! */
-void pnm_init(FILE *fh, int component, char *header)
+/* Color selects a 320x240 PPM, otherwise a 160x120 PGM is produced. Both
+   are divided by scale, which must match the one used by the decoder. */
+void pnm_init(pnm_t *pnm, FILE *fh, int component, int color, int scale,
+  int ascii)
 {
-  output_file = fh;
-  selected_component = component;
-  fputs(header, output_file);
+  pnm->saved_block_no = 0;
+  pnm->selected_component = component;
+  pnm->block_size = 8 / scale;
+  pnm->output_file = fh;
+  pnm->ascii = ascii;
+  pnm->rows_written = 0;
+  pnm->stats = NULL;
+  pnm->filter = NULL;
+  pnm->filtered = NULL;
+
+  if (color) {
+    pnm->width = 320 / scale;
+    pnm->height = 240 / scale;
+    pnm->channels = 3;
+    pnm->band_rows = pnm->block_size * 2; /* Rows are doubled. */
+  } else {
+    pnm->width = 160 / scale;
+    pnm->height = 120 / scale;
+    pnm->channels = 1;
+    pnm->band_rows = pnm->block_size;
+  }
+
+  pnm->band = malloc(pnm->width * pnm->band_rows * pnm->channels);
+  if (pnm->band == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  /* PNM header, dimensions and max-val. */
+  if (ascii)
+    fprintf(fh, "P%d\n%d %d\n255\n", (color) ? 3 : 2,
+      pnm->width, pnm->height);
+  else
+    fprintf(fh, "P%d\n%d %d\n255\n", (color) ? 6 : 5,
+      pnm->width, pnm->height);
 }
 
+
+
+/* Post-process the image with despeckle and sharpen, see filter_init().
+   A despeckle threshold below 0 and a sharpen amount of 0 disable them. */
+void pnm_set_filter(pnm_t *pnm, int despeckle, int sharpen)
+{
+  int size = pnm->width * pnm->channels;
+
+  if (despeckle < 0 && sharpen == 0)
+    return;
+
+  pnm->filter = malloc(sizeof(filter_t));
+  /* The filter output lags behind, and it can finish with two rows. */
+  pnm->filtered = malloc(size * (pnm->band_rows + 2));
+  if (pnm->filter == NULL || pnm->filtered == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+  filter_init(pnm->filter, size, pnm->channels, despeckle, sharpen);
+}
+
+
+
+/* Finish the image in the output file. Returns 0 on success, or -1. */
+int pnm_finish(pnm_t *pnm)
+{
+  int rows;
+
+  /* Areas not covered by picture data are black. */
+  memset(pnm->band, 0, pnm->width * pnm->band_rows * pnm->channels);
+  while (pnm->rows_written < pnm->height) {
+    rows = pnm->height - pnm->rows_written;
+    if (rows > pnm->band_rows)
+      rows = pnm->band_rows;
+    write_band(pnm, rows);
+  }
+
+  if (pnm->filter != NULL) {
+    pnm->filtered_rows = 0;
+    filter_finish(pnm->filter, collect_row, pnm);
+    write_rows(pnm, pnm->filtered, pnm->filtered_rows);
+    filter_free(pnm->filter);
+    free(pnm->filter);
+    free(pnm->filtered);
+    pnm->filter = NULL;
+  }
+
+  free(pnm->band);
+  pnm->band = NULL;
+
+  if (ferror(pnm->output_file))
+    return -1;
+  return 0;
+}
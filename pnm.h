@@ -1,10 +1,35 @@
 #ifndef _PNM_H
 #define _PNM_H
 
+#include "filter.h"
+#include "stats.h"
 #include <stdio.h>
 
-void pnm_block_to_ppm(int block[], int block_no);
-void pnm_component_to_pgm(int block[], int block_no);
-void pnm_init(FILE *fh, int component, char *header);
+/* Converter state, one is needed for each picture converted concurrently. */
+typedef struct pnm_s {
+  /* 4 components, 20 blocks in width, 64 values per block. */
+  /* Actually just 3 components, but luminance has double sampling. */
+  int saved_block[4][20][64];
+  int saved_block_no;
+  int selected_component;
+  int block_size; /* Samples in each row and column of a block. */
+  int width, height, channels;
+  int ascii;
+  FILE *output_file;
+  unsigned char *band; /* Scanlines for one stripe of blocks. */
+  int band_rows;
+  int rows_written;
+  stats_t *stats; /* Color conversion and output timers, if not NULL. */
+  filter_t *filter; /* Post-processing of the scanlines, if not NULL. */
+  unsigned char *filtered; /* Scanlines finished by the filter. */
+  int filtered_rows;
+} pnm_t;
+
+void pnm_block_to_ppm(void *pnm, int block[], int block_no);
+void pnm_component_to_pgm(void *pnm, int block[], int block_no);
+void pnm_init(pnm_t *pnm, FILE *fh, int component, int color, int scale,
+  int ascii);
+void pnm_set_filter(pnm_t *pnm, int despeckle, int sharpen);
+int pnm_finish(pnm_t *pnm);
 
 #endif /* _PNM_H */
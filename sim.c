@@ -0,0 +1,437 @@
+#define _GNU_SOURCE /* posix_openpt() and friends. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+
+/* Camera simulator, speaking the protocol of the Polaroid Digital 320 on a
+   pseudo-terminal. Pictures are served from picture dumps (from -n), and
+   "polaroid -d" can be pointed at the printed device name. */
+
+/* Note: Only the parts of the protocol used by comm.c are simulated, and
+   bytes the camera is not known to send are just zero. */
+
+
+
+#define FRAME_SIZE 2000
+
+/* Checksums for the frame trailer. The real algorithm is not known, the
+   sum is the one assumed by comm.c, and the others are for testing how a
+   wrong assumption is handled. */
+typedef enum {
+  TRAILER_SUM,  /* 16 bit sum of the data bytes. */
+  TRAILER_CRC,  /* CRC-16-CCITT of the data bytes. */
+  TRAILER_ZERO, /* Always zero. */
+} trailer_t;
+
+typedef struct sim_picture_s {
+  unsigned char *data;
+  long size;
+} sim_picture_t;
+
+static sim_picture_t *pictures;
+static int no_of_pictures;
+static char *camera_info = "PDC 320 SIM";
+static long baud = 115200;  /* 0 for no throttling. */
+static int latency = 0;     /* Before each response, in ms. */
+static int corrupt = 0;     /* Corrupt every n:th frame, 0 for none. */
+static int corrupt_stored = 0; /* Same frames of each picture every time. */
+static trailer_t trailer_type = TRAILER_SUM;
+static int verbose = 0;
+static long frames_sent = 0;
+static struct timespec throttle_start;
+static long throttle_bytes;
+
+
+
+static void display_help(void)
+{
+  fprintf(stderr, "\nUsage: polaroid-sim [OPTIONS] FILE...\n"
+    "\nOptions:\n"
+    "  -h          Display this help and exit.\n"
+    "  -b BAUD     Throttle output to BAUD, 0 for no limit (default %ld).\n"
+    "  -l MS       Latency before each response, in milliseconds.\n"
+    "  -e N        Corrupt every N:th picture data frame.\n"
+    "  -p          Corrupt the same frames of a picture on every transfer,\n"
+    "              like data corrupted on the camera, with -e.\n"
+    "  -t TRAILER  Picture data frame checksum: sum (default, as assumed\n"
+    "              by polaroid), crc (CRC-16-CCITT) or zero.\n"
+    "  -i INFO     Camera information string (default \"%s\").\n"
+    "  -v          Log commands to stderr.\n\n"
+    "FILE is a picture dump (from polaroid -n) served as a picture.\n\n",
+    baud, camera_info);
+}
+
+
+
+static void load_picture(const char *name)
+{
+  FILE *fh;
+  long size;
+  unsigned char *data;
+
+  fh = fopen(name, "r");
+  if (fh == NULL)
+    error(1, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+
+  fseek(fh, 0, SEEK_END);
+  size = ftell(fh);
+  rewind(fh);
+
+  data = malloc(size);
+  if (data == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+  if (fread(data, sizeof(unsigned char), size, fh) != size)
+    error(1, errno, "%s.%d: fread(): %s", __FILE__, __LINE__, name);
+  fclose(fh);
+
+  pictures = realloc(pictures, sizeof(sim_picture_t) * (no_of_pictures + 1));
+  if (pictures == NULL)
+    error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+  pictures[no_of_pictures].data = data;
+  pictures[no_of_pictures].size = size;
+  no_of_pictures++;
+}
+
+
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+
+
+/* Send data, no faster than the baud rate allows. */
+/* Note: 10 bits are needed for each byte, with start and stop bits. */
+static void send_data(int pty, const unsigned char *data, long size)
+{
+  long chunk, elapsed;
+  ssize_t written;
+  struct timespec now;
+
+  while (size > 0) {
+    chunk = (size > 64) ? 64 : size;
+
+    written = write(pty, data, chunk);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      error(1, errno, "%s.%d: write()", __FILE__, __LINE__);
+    }
+    data += written;
+    size -= written;
+
+    if (baud > 0) {
+      throttle_bytes += written;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (now.tv_sec - throttle_start.tv_sec) * 1000 +
+        (now.tv_nsec - throttle_start.tv_nsec) / 1000000;
+      if (throttle_bytes * 10000 / baud > elapsed)
+        sleep_ms(throttle_bytes * 10000 / baud - elapsed);
+    }
+  }
+}
+
+
+
+/* Start of a response, waits for the latency and restarts throttling. */
+static void begin_response(void)
+{
+  if (latency > 0)
+    sleep_ms(latency);
+  clock_gettime(CLOCK_MONOTONIC, &throttle_start);
+  throttle_bytes = 0;
+}
+
+
+
+static unsigned int checksum(const unsigned char *data, long size)
+{
+  unsigned int sum;
+  long i;
+  int bit;
+
+  switch (trailer_type) {
+  case TRAILER_SUM:
+    sum = 0;
+    for (i = 0; i < size; i++)
+      sum += data[i];
+    return sum & 0xFFFF;
+
+  case TRAILER_CRC:
+    sum = 0xFFFF;
+    for (i = 0; i < size; i++) {
+      sum ^= data[i] << 8;
+      for (bit = 0; bit < 8; bit++)
+        sum = (sum & 0x8000) ? (sum << 1) ^ 0x1021 : sum << 1;
+    }
+    return sum & 0xFFFF;
+
+  default:
+    return 0;
+  }
+}
+
+
+
+static void send_picture(int pty, int picture_no)
+{
+  sim_picture_t *picture;
+  unsigned char header[5], trailer[2], frame[FRAME_SIZE];
+  unsigned int sum;
+  long offset, size;
+
+  if (picture_no < 1 || picture_no > no_of_pictures) {
+    error(0, 0, "%s.%d: No such picture: %d", __FILE__, __LINE__,
+      picture_no);
+    return;
+  }
+  picture = &pictures[picture_no - 1];
+
+  begin_response();
+  for (offset = 0; offset < picture->size; offset += size) {
+    size = picture->size - offset;
+    if (size > FRAME_SIZE)
+      size = FRAME_SIZE;
+    memcpy(frame, picture->data + offset, size);
+
+    sum = checksum(frame, size);
+
+    frames_sent++;
+    if (corrupt > 0 && ((corrupt_stored) ? offset / FRAME_SIZE + 1 :
+      frames_sent) % corrupt == 0) {
+      if (verbose)
+        fprintf(stderr, "Corrupting frame at offset %ld of picture %d\n",
+          offset, picture_no);
+      frame[size / 2] ^= 0x01;
+    }
+
+    header[0] = 0x04;
+    header[1] = (size >> 24) & 0xFF;
+    header[2] = (size >> 16) & 0xFF;
+    header[3] = (size >> 8) & 0xFF;
+    header[4] = size & 0xFF;
+    trailer[0] = (sum >> 8) & 0xFF;
+    trailer[1] = sum & 0xFF;
+
+    send_data(pty, header, 5);
+    send_data(pty, frame, size);
+    send_data(pty, trailer, 2);
+  }
+}
+
+
+
+static void respond(int pty, unsigned char command, unsigned char argument)
+{
+  unsigned char response[32];
+  long size;
+
+  if (verbose)
+    fprintf(stderr, "Command 0x%02X, argument %d\n", command, argument);
+
+  memset(response, 0, sizeof(response));
+
+  switch (command) {
+  case 0x01: /* Camera information. */
+    response[0] = 0x00;
+    memset(response + 1, ' ', 13);
+    memcpy(response + 1, camera_info,
+      (strlen(camera_info) > 13) ? 13 : strlen(camera_info));
+    begin_response();
+    send_data(pty, response, 14);
+    break;
+
+  case 0x02: /* Camera state, with picture dimensions. */
+    response[0] = 0x02;
+    response[2] = 320 >> 8;
+    response[3] = 320 & 0xFF;
+    response[4] = 240 >> 8;
+    response[5] = 240 & 0xFF;
+    begin_response();
+    send_data(pty, response, 24);
+    break;
+
+  case 0x03: /* Number of pictures. */
+    response[0] = 0x03;
+    response[1] = no_of_pictures;
+    begin_response();
+    send_data(pty, response, 2);
+    break;
+
+  case 0x04: /* Picture size. */
+    size = 0;
+    if (argument >= 1 && argument <= no_of_pictures)
+      size = pictures[argument - 1].size;
+    response[0] = 0x06;
+    response[1] = (size >> 24) & 0xFF;
+    response[2] = (size >> 16) & 0xFF;
+    response[3] = (size >> 8) & 0xFF;
+    response[4] = size & 0xFF;
+    begin_response();
+    send_data(pty, response, 7);
+    break;
+
+  case 0x05: /* Picture data. */
+    send_picture(pty, argument);
+    break;
+
+  case 0x07: /* Erase all pictures. */
+    no_of_pictures = 0;
+    /* Fall through. */
+
+  default: /* Initialization and others, acknowledged with the command. */
+    response[0] = command;
+    begin_response();
+    send_data(pty, response, 1);
+    break;
+  }
+}
+
+
+
+/* Commands are preceded by 0xE6 bytes, and followed by the inverted
+   command. Commands with an argument also have the inverted argument, while
+   the special init command is "0x00 0xFF 0xFF". */
+static void serve(int pty)
+{
+  unsigned char buffer[256];
+  int size, used, length;
+  ssize_t data_read;
+
+  size = 0;
+  while (1) {
+    data_read = read(pty, buffer + size, sizeof(buffer) - size);
+    if (data_read == -1) {
+      if (errno == EINTR)
+        continue;
+      error(1, errno, "%s.%d: read()", __FILE__, __LINE__);
+    }
+    size += data_read;
+
+    used = 0;
+    while (1) {
+      while (used < size && buffer[used] == 0xE6)
+        used++;
+      if (size - used < 3)
+        break;
+
+      length = (buffer[used] == 0x04 || buffer[used] == 0x05) ? 4 : 3;
+      if (size - used < length)
+        break;
+
+      if (buffer[used] == 0x00)
+        respond(pty, 0x00, 0);
+      else if ((buffer[used] ^ 0xFF) != buffer[used + ((length == 4) ? 2 : 1)])
+        error(0, 0, "%s.%d: Invalid command: 0x%02X", __FILE__, __LINE__,
+          buffer[used]);
+      else
+        respond(pty, buffer[used], (length == 4) ? buffer[used + 1] : 0);
+      used += length;
+    }
+
+    memmove(buffer, buffer + used, size - used);
+    size -= used;
+    if (size == sizeof(buffer))
+      size = 0; /* Garbage, start over. */
+  }
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c, pty, slave;
+  char *slave_name;
+  struct termios tty_settings;
+
+  while ((c = getopt(argc, argv, "hb:l:e:pt:i:v")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help();
+      return 0;
+
+    case 'b':
+      baud = atol(optarg);
+      break;
+
+    case 'l':
+      latency = atoi(optarg);
+      break;
+
+    case 'e':
+      corrupt = atoi(optarg);
+      break;
+
+    case 'p':
+      corrupt_stored = 1;
+      break;
+
+    case 't':
+      if (strcmp(optarg, "sum") == 0)
+        trailer_type = TRAILER_SUM;
+      else if (strcmp(optarg, "crc") == 0)
+        trailer_type = TRAILER_CRC;
+      else if (strcmp(optarg, "zero") == 0)
+        trailer_type = TRAILER_ZERO;
+      else
+        error(1, 0, "%s.%d: Unknown trailer: %s", __FILE__, __LINE__,
+          optarg);
+      break;
+
+    case 'i':
+      camera_info = optarg;
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case '?':
+    default:
+      display_help();
+      return 1;
+    }
+  }
+
+  for (; optind < argc; optind++)
+    load_picture(argv[optind]);
+
+  pty = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty == -1)
+    error(1, errno, "%s.%d: posix_openpt()", __FILE__, __LINE__);
+  if (grantpt(pty) == -1 || unlockpt(pty) == -1)
+    error(1, errno, "%s.%d: grantpt()", __FILE__, __LINE__);
+  slave_name = ptsname(pty);
+  if (slave_name == NULL)
+    error(1, errno, "%s.%d: ptsname()", __FILE__, __LINE__);
+
+  /* Note: Keeping the slave open means the pty stays usable between
+     sessions, and the raw mode is there before the first one. */
+  slave = open(slave_name, O_RDWR | O_NOCTTY);
+  if (slave == -1)
+    error(1, errno, "%s.%d: open(): %s", __FILE__, __LINE__, slave_name);
+  if (tcgetattr(slave, &tty_settings) == -1)
+    error(1, errno, "%s.%d: tcgetattr()", __FILE__, __LINE__);
+  cfmakeraw(&tty_settings);
+  if (tcsetattr(slave, TCSANOW, &tty_settings) == -1)
+    error(1, errno, "%s.%d: tcsetattr()", __FILE__, __LINE__);
+
+  printf("%s\n", slave_name);
+  fflush(stdout);
+
+  serve(pty);
+
+  return 0;
+}
@@ -0,0 +1,586 @@
+#include "simd.h"
+#include "idct.h"
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Kernels with runtime CPU dispatch. */
+
+
+
+static void ycc_to_rgb_generic(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n);
+
+/* Note: The defaults work without simd_init(). */
+void (*simd_idct)(int block[]) = idct_fast;
+void (*simd_ycc_to_rgb)(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n) = ycc_to_rgb_generic;
+
+static simd_t selected = SIMD_NONE;
+
+
+
+/* Color conversion is done in fixed-point, with the JFIF factors scaled by
+   2^COLOR_BITS. The chroma terms are rounded down, like the truncation of
+   the floating-point formula they replace, since values below zero are
+   clamped anyway. */
+#define COLOR_BITS 20
+#define COLOR_FIX(x) ((int)((x) * (1 << COLOR_BITS) + 0.5))
+#define COLOR_CR_R COLOR_FIX(1.402)
+#define COLOR_CB_G COLOR_FIX(0.34414)
+#define COLOR_CR_G COLOR_FIX(0.71414)
+#define COLOR_CB_B COLOR_FIX(1.772)
+
+/* Chroma terms for each Cb or Cr value. The green ones are still scaled,
+   and rounded down after being added together. */
+static int color_cr_r[256], color_cb_g[256], color_cr_g[256], color_cb_b[256];
+
+/* Saturating clamp, indexed by luminance plus a chroma term. The terms are
+   below 256 in magnitude. */
+#define COLOR_LIMIT_OFFSET 256
+static unsigned char color_limit[256 + 2 * COLOR_LIMIT_OFFSET];
+
+/* The tables are built on first use, by whichever thread gets there. */
+static pthread_once_t color_once = PTHREAD_ONCE_INIT;
+
+
+
+static void color_init(void)
+{
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    color_cr_r[i] = (COLOR_CR_R * (i - 128)) >> COLOR_BITS;
+    color_cb_g[i] = -COLOR_CB_G * (i - 128);
+    color_cr_g[i] = -COLOR_CR_G * (i - 128);
+    color_cb_b[i] = (COLOR_CB_B * (i - 128)) >> COLOR_BITS;
+  }
+
+  for (i = 0; i < sizeof(color_limit); i++) {
+    if (i < COLOR_LIMIT_OFFSET)
+      color_limit[i] = 0;
+    else if (i - COLOR_LIMIT_OFFSET > 255)
+      color_limit[i] = 255;
+    else
+      color_limit[i] = i - COLOR_LIMIT_OFFSET;
+  }
+}
+
+
+
+static void ycc_to_rgb_generic(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n)
+{
+  int i, r, g, b;
+  const unsigned char *limit = color_limit + COLOR_LIMIT_OFFSET;
+
+  /* Note: The only kernel reachable without simd_init(). */
+  pthread_once(&color_once, color_init);
+
+  /* The chroma terms are shared by each pair of pixels. */
+  for (i = 0; i < n; i += 2) {
+    r = color_cr_r[cr[i / 2]];
+    g = (color_cb_g[cb[i / 2]] + color_cr_g[cr[i / 2]]) >> COLOR_BITS;
+    b = color_cb_b[cb[i / 2]];
+
+    rgb[0] = limit[y[i] + r];
+    rgb[1] = limit[y[i] + g];
+    rgb[2] = limit[y[i] + b];
+    rgb[3] = limit[y[i + 1] + r];
+    rgb[4] = limit[y[i + 1] + g];
+    rgb[5] = limit[y[i + 1] + b];
+    rgb += 6;
+  }
+}
+
+
+
+#ifdef SIMD_X86
+/* SSE2 has no 32-bit multiply keeping the low half, so build one from the
+   unsigned 32x32->64 multiply. The low 32 bits are the same for signed. */
+__attribute__((target("sse2")))
+static inline __m128i mullo_sse2(__m128i a, __m128i b)
+{
+  __m128i even, odd;
+
+  even = _mm_mul_epu32(a, b);
+  odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+
+__attribute__((target("sse2")))
+static inline void transpose4_sse2(__m128i *a, __m128i *b, __m128i *c,
+  __m128i *d)
+{
+  __m128i t0, t1, t2, t3;
+
+  t0 = _mm_unpacklo_epi32(*a, *b);
+  t1 = _mm_unpacklo_epi32(*c, *d);
+  t2 = _mm_unpackhi_epi32(*a, *b);
+  t3 = _mm_unpackhi_epi32(*c, *d);
+  *a = _mm_unpacklo_epi64(t0, t1);
+  *b = _mm_unpackhi_epi64(t0, t1);
+  *c = _mm_unpacklo_epi64(t2, t3);
+  *d = _mm_unpackhi_epi64(t2, t3);
+}
+
+
+
+/* One pass of the integer IDCT on 4 lanes, see idct_fast() for details. */
+__attribute__((target("sse2")))
+static inline void idct_pass_sse2(__m128i v[8], int shift)
+{
+  __m128i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+  __m128i z1, z2, z3, z4, z5, round;
+  __m128i count;
+
+  round = _mm_set1_epi32(1 << (shift - 1));
+  count = _mm_cvtsi32_si128(shift);
+
+  /* Even part. */
+  z2 = v[2];
+  z3 = v[6];
+  z1 = mullo_sse2(_mm_add_epi32(z2, z3), _mm_set1_epi32(FIX_0_541196100));
+  tmp2 = _mm_sub_epi32(z1, mullo_sse2(z3, _mm_set1_epi32(FIX_1_847759065)));
+  tmp3 = _mm_add_epi32(z1, mullo_sse2(z2, _mm_set1_epi32(FIX_0_765366865)));
+
+  tmp0 = _mm_slli_epi32(_mm_add_epi32(v[0], v[4]), CONST_BITS);
+  tmp1 = _mm_slli_epi32(_mm_sub_epi32(v[0], v[4]), CONST_BITS);
+
+  tmp10 = _mm_add_epi32(tmp0, tmp3);
+  tmp13 = _mm_sub_epi32(tmp0, tmp3);
+  tmp11 = _mm_add_epi32(tmp1, tmp2);
+  tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+  /* Odd part. */
+  tmp0 = v[7];
+  tmp1 = v[5];
+  tmp2 = v[3];
+  tmp3 = v[1];
+
+  z1 = _mm_add_epi32(tmp0, tmp3);
+  z2 = _mm_add_epi32(tmp1, tmp2);
+  z3 = _mm_add_epi32(tmp0, tmp2);
+  z4 = _mm_add_epi32(tmp1, tmp3);
+  z5 = mullo_sse2(_mm_add_epi32(z3, z4), _mm_set1_epi32(FIX_1_175875602));
+
+  tmp0 = mullo_sse2(tmp0, _mm_set1_epi32(FIX_0_298631336));
+  tmp1 = mullo_sse2(tmp1, _mm_set1_epi32(FIX_2_053119869));
+  tmp2 = mullo_sse2(tmp2, _mm_set1_epi32(FIX_3_072711026));
+  tmp3 = mullo_sse2(tmp3, _mm_set1_epi32(FIX_1_501321110));
+  z1 = mullo_sse2(z1, _mm_set1_epi32(- FIX_0_899976223));
+  z2 = mullo_sse2(z2, _mm_set1_epi32(- FIX_2_562915447));
+  z3 = mullo_sse2(z3, _mm_set1_epi32(- FIX_1_961570560));
+  z4 = mullo_sse2(z4, _mm_set1_epi32(- FIX_0_390180644));
+
+  z3 = _mm_add_epi32(z3, z5);
+  z4 = _mm_add_epi32(z4, z5);
+
+  tmp0 = _mm_add_epi32(tmp0, _mm_add_epi32(z1, z3));
+  tmp1 = _mm_add_epi32(tmp1, _mm_add_epi32(z2, z4));
+  tmp2 = _mm_add_epi32(tmp2, _mm_add_epi32(z2, z3));
+  tmp3 = _mm_add_epi32(tmp3, _mm_add_epi32(z1, z4));
+
+  tmp10 = _mm_add_epi32(tmp10, round);
+  tmp11 = _mm_add_epi32(tmp11, round);
+  tmp12 = _mm_add_epi32(tmp12, round);
+  tmp13 = _mm_add_epi32(tmp13, round);
+
+  v[0] = _mm_sra_epi32(_mm_add_epi32(tmp10, tmp3), count);
+  v[7] = _mm_sra_epi32(_mm_sub_epi32(tmp10, tmp3), count);
+  v[1] = _mm_sra_epi32(_mm_add_epi32(tmp11, tmp2), count);
+  v[6] = _mm_sra_epi32(_mm_sub_epi32(tmp11, tmp2), count);
+  v[2] = _mm_sra_epi32(_mm_add_epi32(tmp12, tmp1), count);
+  v[5] = _mm_sra_epi32(_mm_sub_epi32(tmp12, tmp1), count);
+  v[3] = _mm_sra_epi32(_mm_add_epi32(tmp13, tmp0), count);
+  v[4] = _mm_sra_epi32(_mm_sub_epi32(tmp13, tmp0), count);
+}
+
+
+
+/* The block is handled as a left and right half of 4 columns each. */
+__attribute__((target("sse2")))
+static void idct_sse2(int block[])
+{
+  int i;
+  __m128i left[8], right[8], top[8], bottom[8];
+
+  /* Pass 1: Columns, each vector holds one row of 4 columns. */
+  for (i = 0; i < 8; i++) {
+    left[i]  = _mm_loadu_si128((__m128i *)(block + (i * 8)));
+    right[i] = _mm_loadu_si128((__m128i *)(block + (i * 8) + 4));
+  }
+  idct_pass_sse2(left, CONST_BITS - PASS1_BITS);
+  idct_pass_sse2(right, CONST_BITS - PASS1_BITS);
+
+  /* Transpose, so each vector holds one column of 4 rows. */
+  transpose4_sse2(&left[0], &left[1], &left[2], &left[3]);
+  transpose4_sse2(&left[4], &left[5], &left[6], &left[7]);
+  transpose4_sse2(&right[0], &right[1], &right[2], &right[3]);
+  transpose4_sse2(&right[4], &right[5], &right[6], &right[7]);
+  for (i = 0; i < 4; i++) {
+    top[i]        = left[i];
+    top[i + 4]    = right[i];
+    bottom[i]     = left[i + 4];
+    bottom[i + 4] = right[i + 4];
+  }
+
+  /* Pass 2: Rows. */
+  idct_pass_sse2(top, CONST_BITS + PASS1_BITS + 3);
+  idct_pass_sse2(bottom, CONST_BITS + PASS1_BITS + 3);
+
+  /* Transpose back and store. */
+  transpose4_sse2(&top[0], &top[1], &top[2], &top[3]);
+  transpose4_sse2(&top[4], &top[5], &top[6], &top[7]);
+  transpose4_sse2(&bottom[0], &bottom[1], &bottom[2], &bottom[3]);
+  transpose4_sse2(&bottom[4], &bottom[5], &bottom[6], &bottom[7]);
+  for (i = 0; i < 4; i++) {
+    _mm_storeu_si128((__m128i *)(block + (i * 8)), top[i]);
+    _mm_storeu_si128((__m128i *)(block + (i * 8) + 4), top[i + 4]);
+    _mm_storeu_si128((__m128i *)(block + ((i + 4) * 8)), bottom[i]);
+    _mm_storeu_si128((__m128i *)(block + ((i + 4) * 8) + 4), bottom[i + 4]);
+  }
+}
+
+
+
+/* Same fixed-point math as the C version, for 8 pixels at a time. */
+__attribute__((target("sse2")))
+static void ycc_to_rgb_sse2(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n)
+{
+  int i, j;
+  __m128i cbv, crv, rv, gv, bv, y0, y1, offset, packed;
+  unsigned char r[8], g[8], b[8];
+
+  offset = _mm_set1_epi32(128);
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    cbv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(cb + i / 2)), offset);
+    crv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(cr + i / 2)), offset);
+    y0 = _mm_loadu_si128((__m128i *)(y + i));
+    y1 = _mm_loadu_si128((__m128i *)(y + i + 4));
+
+    rv = _mm_srai_epi32(mullo_sse2(crv, _mm_set1_epi32(COLOR_CR_R)),
+      COLOR_BITS);
+    gv = _mm_srai_epi32(_mm_sub_epi32(_mm_setzero_si128(), _mm_add_epi32(
+      mullo_sse2(cbv, _mm_set1_epi32(COLOR_CB_G)),
+      mullo_sse2(crv, _mm_set1_epi32(COLOR_CR_G)))), COLOR_BITS);
+    bv = _mm_srai_epi32(mullo_sse2(cbv, _mm_set1_epi32(COLOR_CB_B)),
+      COLOR_BITS);
+
+    /* Each chroma term is added to a pair of pixels, and the saturating
+       packs take care of the clamping. */
+    packed = _mm_packs_epi32(_mm_add_epi32(y0, _mm_unpacklo_epi32(rv, rv)),
+      _mm_add_epi32(y1, _mm_unpackhi_epi32(rv, rv)));
+    _mm_storel_epi64((__m128i *)r, _mm_packus_epi16(packed, packed));
+    packed = _mm_packs_epi32(_mm_add_epi32(y0, _mm_unpacklo_epi32(gv, gv)),
+      _mm_add_epi32(y1, _mm_unpackhi_epi32(gv, gv)));
+    _mm_storel_epi64((__m128i *)g, _mm_packus_epi16(packed, packed));
+    packed = _mm_packs_epi32(_mm_add_epi32(y0, _mm_unpacklo_epi32(bv, bv)),
+      _mm_add_epi32(y1, _mm_unpackhi_epi32(bv, bv)));
+    _mm_storel_epi64((__m128i *)b, _mm_packus_epi16(packed, packed));
+
+    for (j = 0; j < 8; j++) {
+      rgb[j * 3]     = r[j];
+      rgb[j * 3 + 1] = g[j];
+      rgb[j * 3 + 2] = b[j];
+    }
+    rgb += 24;
+  }
+
+  ycc_to_rgb_generic(y + i, cb + i / 2, cr + i / 2, rgb, n - i);
+}
+
+
+
+__attribute__((target("avx2")))
+static inline void transpose8_avx2(__m256i v[8])
+{
+  __m256i t[8], u[8];
+  int i;
+
+  for (i = 0; i < 8; i += 2) {
+    t[i]     = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+  }
+  for (i = 0; i < 8; i += 4) {
+    u[i]     = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+  for (i = 0; i < 4; i++) {
+    v[i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+    v[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+  }
+}
+
+
+
+/* One pass of the integer IDCT on 8 lanes, see idct_fast() for details. */
+__attribute__((target("avx2")))
+static inline void idct_pass_avx2(__m256i v[8], int shift)
+{
+  __m256i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+  __m256i z1, z2, z3, z4, z5, round;
+  __m128i count;
+
+  round = _mm256_set1_epi32(1 << (shift - 1));
+  count = _mm_cvtsi32_si128(shift);
+
+  /* Even part. */
+  z2 = v[2];
+  z3 = v[6];
+  z1 = _mm256_mullo_epi32(_mm256_add_epi32(z2, z3),
+    _mm256_set1_epi32(FIX_0_541196100));
+  tmp2 = _mm256_sub_epi32(z1,
+    _mm256_mullo_epi32(z3, _mm256_set1_epi32(FIX_1_847759065)));
+  tmp3 = _mm256_add_epi32(z1,
+    _mm256_mullo_epi32(z2, _mm256_set1_epi32(FIX_0_765366865)));
+
+  tmp0 = _mm256_slli_epi32(_mm256_add_epi32(v[0], v[4]), CONST_BITS);
+  tmp1 = _mm256_slli_epi32(_mm256_sub_epi32(v[0], v[4]), CONST_BITS);
+
+  tmp10 = _mm256_add_epi32(tmp0, tmp3);
+  tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+  tmp11 = _mm256_add_epi32(tmp1, tmp2);
+  tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+  /* Odd part. */
+  tmp0 = v[7];
+  tmp1 = v[5];
+  tmp2 = v[3];
+  tmp3 = v[1];
+
+  z1 = _mm256_add_epi32(tmp0, tmp3);
+  z2 = _mm256_add_epi32(tmp1, tmp2);
+  z3 = _mm256_add_epi32(tmp0, tmp2);
+  z4 = _mm256_add_epi32(tmp1, tmp3);
+  z5 = _mm256_mullo_epi32(_mm256_add_epi32(z3, z4),
+    _mm256_set1_epi32(FIX_1_175875602));
+
+  tmp0 = _mm256_mullo_epi32(tmp0, _mm256_set1_epi32(FIX_0_298631336));
+  tmp1 = _mm256_mullo_epi32(tmp1, _mm256_set1_epi32(FIX_2_053119869));
+  tmp2 = _mm256_mullo_epi32(tmp2, _mm256_set1_epi32(FIX_3_072711026));
+  tmp3 = _mm256_mullo_epi32(tmp3, _mm256_set1_epi32(FIX_1_501321110));
+  z1 = _mm256_mullo_epi32(z1, _mm256_set1_epi32(- FIX_0_899976223));
+  z2 = _mm256_mullo_epi32(z2, _mm256_set1_epi32(- FIX_2_562915447));
+  z3 = _mm256_mullo_epi32(z3, _mm256_set1_epi32(- FIX_1_961570560));
+  z4 = _mm256_mullo_epi32(z4, _mm256_set1_epi32(- FIX_0_390180644));
+
+  z3 = _mm256_add_epi32(z3, z5);
+  z4 = _mm256_add_epi32(z4, z5);
+
+  tmp0 = _mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+  tmp1 = _mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+  tmp2 = _mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+  tmp3 = _mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+
+  tmp10 = _mm256_add_epi32(tmp10, round);
+  tmp11 = _mm256_add_epi32(tmp11, round);
+  tmp12 = _mm256_add_epi32(tmp12, round);
+  tmp13 = _mm256_add_epi32(tmp13, round);
+
+  v[0] = _mm256_sra_epi32(_mm256_add_epi32(tmp10, tmp3), count);
+  v[7] = _mm256_sra_epi32(_mm256_sub_epi32(tmp10, tmp3), count);
+  v[1] = _mm256_sra_epi32(_mm256_add_epi32(tmp11, tmp2), count);
+  v[6] = _mm256_sra_epi32(_mm256_sub_epi32(tmp11, tmp2), count);
+  v[2] = _mm256_sra_epi32(_mm256_add_epi32(tmp12, tmp1), count);
+  v[5] = _mm256_sra_epi32(_mm256_sub_epi32(tmp12, tmp1), count);
+  v[3] = _mm256_sra_epi32(_mm256_add_epi32(tmp13, tmp0), count);
+  v[4] = _mm256_sra_epi32(_mm256_sub_epi32(tmp13, tmp0), count);
+}
+
+
+
+__attribute__((target("avx2")))
+static void idct_avx2(int block[])
+{
+  int i;
+  __m256i v[8];
+
+  /* Pass 1: Columns, each vector holds one row. */
+  for (i = 0; i < 8; i++)
+    v[i] = _mm256_loadu_si256((__m256i *)(block + (i * 8)));
+  idct_pass_avx2(v, CONST_BITS - PASS1_BITS);
+
+  /* Pass 2: Rows, each vector holds one column after transposing. */
+  transpose8_avx2(v);
+  idct_pass_avx2(v, CONST_BITS + PASS1_BITS + 3);
+  transpose8_avx2(v);
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256((__m256i *)(block + (i * 8)), v[i]);
+}
+
+
+
+/* Same fixed-point math as the C version, for 8 pixels at a time. */
+__attribute__((target("avx2")))
+static void ycc_to_rgb_avx2(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n)
+{
+  int i, j;
+  __m128i cbv, crv, rv, gv, bv, offset, packed;
+  __m256i yv, pairs, sum;
+  unsigned char r[8], g[8], b[8];
+
+  offset = _mm_set1_epi32(128);
+  pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    cbv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(cb + i / 2)), offset);
+    crv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(cr + i / 2)), offset);
+    yv = _mm256_loadu_si256((__m256i *)(y + i));
+
+    rv = _mm_srai_epi32(_mm_mullo_epi32(crv, _mm_set1_epi32(COLOR_CR_R)),
+      COLOR_BITS);
+    gv = _mm_srai_epi32(_mm_sub_epi32(_mm_setzero_si128(), _mm_add_epi32(
+      _mm_mullo_epi32(cbv, _mm_set1_epi32(COLOR_CB_G)),
+      _mm_mullo_epi32(crv, _mm_set1_epi32(COLOR_CR_G)))), COLOR_BITS);
+    bv = _mm_srai_epi32(_mm_mullo_epi32(cbv, _mm_set1_epi32(COLOR_CB_B)),
+      COLOR_BITS);
+
+    /* Each chroma term is added to a pair of pixels, and the saturating
+       packs take care of the clamping. */
+    sum = _mm256_add_epi32(yv, _mm256_permutevar8x32_epi32(
+      _mm256_castsi128_si256(rv), pairs));
+    packed = _mm_packs_epi32(_mm256_castsi256_si128(sum),
+      _mm256_extracti128_si256(sum, 1));
+    _mm_storel_epi64((__m128i *)r, _mm_packus_epi16(packed, packed));
+    sum = _mm256_add_epi32(yv, _mm256_permutevar8x32_epi32(
+      _mm256_castsi128_si256(gv), pairs));
+    packed = _mm_packs_epi32(_mm256_castsi256_si128(sum),
+      _mm256_extracti128_si256(sum, 1));
+    _mm_storel_epi64((__m128i *)g, _mm_packus_epi16(packed, packed));
+    sum = _mm256_add_epi32(yv, _mm256_permutevar8x32_epi32(
+      _mm256_castsi128_si256(bv), pairs));
+    packed = _mm_packs_epi32(_mm256_castsi256_si128(sum),
+      _mm256_extracti128_si256(sum, 1));
+    _mm_storel_epi64((__m128i *)b, _mm_packus_epi16(packed, packed));
+
+    for (j = 0; j < 8; j++) {
+      rgb[j * 3]     = r[j];
+      rgb[j * 3 + 1] = g[j];
+      rgb[j * 3 + 2] = b[j];
+    }
+    rgb += 24;
+  }
+
+  ycc_to_rgb_generic(y + i, cb + i / 2, cr + i / 2, rgb, n - i);
+}
+#endif /* SIMD_X86 */
+
+
+
+static int simd_supported(simd_t simd)
+{
+  switch (simd) {
+  case SIMD_NONE:
+    return 1;
+#ifdef SIMD_X86
+  case SIMD_SSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+  case SIMD_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+
+
+/* Select kernels, SIMD_AUTO uses the POLAROID_SIMD environment variable if
+   set, otherwise the best kernels supported by the CPU (CPUID). */
+void simd_init(simd_t simd)
+{
+  char *env;
+
+  if (simd == SIMD_AUTO) {
+    env = getenv("POLAROID_SIMD");
+    if (env != NULL && simd_parse(env, &simd) == -1)
+      error(1, 0, "%s.%d: Unknown POLAROID_SIMD value: %s",
+        __FILE__, __LINE__, env);
+  }
+
+  if (simd == SIMD_AUTO) {
+    if (simd_supported(SIMD_AVX2))
+      simd = SIMD_AVX2;
+    else if (simd_supported(SIMD_SSE2))
+      simd = SIMD_SSE2;
+    else
+      simd = SIMD_NONE;
+  }
+
+  if (! simd_supported(simd))
+    error(1, 0, "%s.%d: Kernels not supported by this CPU: %s",
+      __FILE__, __LINE__, (simd == SIMD_AVX2) ? "avx2" : "sse2");
+
+  switch (simd) {
+#ifdef SIMD_X86
+  case SIMD_SSE2:
+    simd_idct = idct_sse2;
+    simd_ycc_to_rgb = ycc_to_rgb_sse2;
+    break;
+
+  case SIMD_AVX2:
+    simd_idct = idct_avx2;
+    simd_ycc_to_rgb = ycc_to_rgb_avx2;
+    break;
+#endif
+
+  default:
+    simd_idct = idct_fast;
+    simd_ycc_to_rgb = ycc_to_rgb_generic;
+    break;
+  }
+
+  pthread_once(&color_once, color_init);
+  selected = simd;
+}
+
+
+
+/* Returns 0 and sets the choice if the name is known, otherwise -1. */
+int simd_parse(const char *name, simd_t *simd)
+{
+  if (strcmp(name, "auto") == 0)
+    *simd = SIMD_AUTO;
+  else if (strcmp(name, "none") == 0)
+    *simd = SIMD_NONE;
+  else if (strcmp(name, "sse2") == 0)
+    *simd = SIMD_SSE2;
+  else if (strcmp(name, "avx2") == 0)
+    *simd = SIMD_AVX2;
+  else
+    return -1;
+
+  return 0;
+}
+
+
+
+const char *simd_name(void)
+{
+  switch (selected) {
+  case SIMD_SSE2:
+    return "sse2";
+  case SIMD_AVX2:
+    return "avx2";
+  default:
+    return "none";
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+typedef enum {
+  SIMD_AUTO, /* Best kernels supported by the CPU. */
+  SIMD_NONE, /* Plain C kernels. */
+  SIMD_SSE2,
+  SIMD_AVX2,
+} simd_t;
+
+/* Kernels selected by simd_init(), all variants give identical results. */
+extern void (*simd_idct)(int block[]); /* Same as idct_fast(). */
+/* Converts n pixels, n even, to interleaved RGB. Each Cb and Cr value is
+   shared by a pair of pixels, and all values must be in 0..255. */
+extern void (*simd_ycc_to_rgb)(const int y[], const int cb[], const int cr[],
+  unsigned char rgb[], int n);
+
+void simd_init(simd_t simd);
+int simd_parse(const char *name, simd_t *simd);
+const char *simd_name(void);
+
+#endif /* _SIMD_H */
@@ -0,0 +1,136 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+
+/* Stats report, written as one line of JSON for each picture and a summary
+   for the whole run when closed. Pictures can be reported from several
+   threads, so the file and the run totals are protected by a mutex. */
+
+static FILE *stats_file = NULL;
+static stats_t stats_run;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stage_names[STATS_STAGES] = {
+  "transfer", "entropy", "idct", "color", "filter", "output",
+};
+
+
+
+void stats_init(stats_t *stats)
+{
+  memset(stats, 0, sizeof(stats_t));
+}
+
+
+
+/* Start a report to the named file. Returns 0 on success, or -1 on error. */
+int stats_open(const char *name)
+{
+  stats_file = fopen(name, "w");
+  if (stats_file == NULL) {
+    error(0, errno, "%s.%d: fopen(): %s", __FILE__, __LINE__, name);
+    return -1;
+  }
+
+  stats_init(&stats_run);
+  return 0;
+}
+
+
+
+/* Returns non-zero if a report was started. */
+int stats_enabled(void)
+{
+  return stats_file != NULL;
+}
+
+
+
+static void write_array(const char *key, const long values[], int count)
+{
+  int i;
+
+  fprintf(stats_file, "\"%s\":[", key);
+  for (i = 0; i < count; i++)
+    fprintf(stats_file, (i == 0) ? "%ld" : ",%ld", values[i]);
+  fprintf(stats_file, "]");
+}
+
+
+
+/* Write the members common to pictures and the run summary. */
+static void write_stats(const stats_t *stats)
+{
+  int i;
+
+  fprintf(stats_file, "\"bytes\":%ld,\"blocks\":%ld,\"bits\":%lld,",
+    stats->bytes, stats->blocks, (long long)stats->bits);
+
+  fprintf(stats_file, "\"time_ns\":{");
+  for (i = 0; i < STATS_STAGES; i++)
+    fprintf(stats_file, "%s\"%s\":%lld", (i == 0) ? "" : ",",
+      stage_names[i], (long long)stats->time[i]);
+  fprintf(stats_file, "},");
+
+  write_array("eob", stats->eob, 64);
+  fprintf(stats_file, ",");
+  write_array("zero_runs", stats->zero_runs, 64);
+}
+
+
+
+/* Report the stats for one picture, and add them to the run totals. */
+void stats_report(const stats_t *stats, const char *name)
+{
+  int i;
+
+  if (stats_file == NULL)
+    return;
+
+  pthread_mutex_lock(&stats_mutex);
+
+  /* Note: The name comes from file or dump names, only quotes and
+     backslashes are escaped. */
+  fprintf(stats_file, "{\"picture\":\"");
+  for (i = 0; name[i] != '\0'; i++) {
+    if (name[i] == '"' || name[i] == '\\')
+      fputc('\\', stats_file);
+    fputc(name[i], stats_file);
+  }
+  fprintf(stats_file, "\",");
+  write_stats(stats);
+  fprintf(stats_file, "}\n");
+  fflush(stats_file);
+
+  stats_run.pictures++;
+  stats_run.bytes += stats->bytes;
+  stats_run.blocks += stats->blocks;
+  stats_run.bits += stats->bits;
+  for (i = 0; i < STATS_STAGES; i++)
+    stats_run.time[i] += stats->time[i];
+  for (i = 0; i < 64; i++) {
+    stats_run.eob[i] += stats->eob[i];
+    stats_run.zero_runs[i] += stats->zero_runs[i];
+  }
+
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+
+
+/* Write the run summary and end the report. */
+void stats_close(void)
+{
+  if (stats_file == NULL)
+    return;
+
+  fprintf(stats_file, "{\"run\":{\"pictures\":%ld,", stats_run.pictures);
+  write_stats(&stats_run);
+  fprintf(stats_file, "}}\n");
+
+  fclose(stats_file);
+  stats_file = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Stages timed for each picture. Dequantization and zig-zag re-ordering
+   are done while entropy decoding, so they are part of that stage. */
+typedef enum {
+  STATS_TRANSFER,
+  STATS_ENTROPY,
+  STATS_IDCT,
+  STATS_COLOR,
+  STATS_FILTER,
+  STATS_OUTPUT,
+  STATS_STAGES,
+} stats_stage_t;
+
+/* Counters for one picture, or the sum for a run. Collected by the decoder
+   and converters when given one, a NULL pointer means disabled. */
+typedef struct stats_s {
+  int64_t time[STATS_STAGES]; /* Nanoseconds. */
+  long pictures;
+  long bytes;  /* Picture data size. */
+  long blocks;
+  int64_t bits; /* Consumed by the decoder, including stuffed bytes. */
+  long eob[64]; /* Blocks by zig-zag index of the last coefficient. */
+  long zero_runs[64]; /* Zero coefficients before a non-zero one. */
+} stats_t;
+
+/* Monotonic time in nanoseconds, for the stage timers. */
+static inline int64_t stats_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_init(stats_t *stats);
+int stats_open(const char *name);
+int stats_enabled(void);
+void stats_report(const stats_t *stats, const char *name);
+void stats_close(void);
+
+#endif /* _STATS_H */
@@ -0,0 +1,273 @@
+#include "sweep.h"
+#include "jpeg.h"
+#include "pnm.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <error.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* Quantization sweep, a picture rendered with many quantization settings.
+   The picture data is entropy decoded only once, and the settings are
+   rendered from the decoded coefficients on a pool of worker threads. */
+
+#define SWEEP_MAX_SETTINGS 4096
+
+
+
+typedef struct sweep_job_s {
+  const sweep_t *sweep;
+  const jpeg_blocks_t *blocks;
+  const convert_options_t *options;
+  const char *base;
+  int next;   /* Index of next setting to be picked by a worker. */
+  int failed;
+  pthread_mutex_t lock;
+} sweep_job_t;
+
+
+
+/* Parse a value, or a range of values like "2-6", moving past it. */
+/* Returns 0 on success, or -1 on error. */
+static int parse_range(const char **spec, int *low, int *high)
+{
+  char *end;
+
+  *low = strtol(*spec, &end, 10);
+  if (end == *spec)
+    return -1;
+  *high = *low;
+
+  if (*end == '-') {
+    *spec = end + 1;
+    *high = strtol(*spec, &end, 10);
+    if (end == *spec)
+      return -1;
+  }
+  *spec = end;
+
+  if (*low < 0 || *high > 255 || *low > *high)
+    return -1;
+  return 0;
+}
+
+
+
+/* Parse settings like "4,2,2:3-6,1-3,2", with luminance, Cb and Cr
+   quantization values separated by ':'. Each value can be a range, which
+   gives every combination of the values in the ranges.
+   Returns 0 on success, or -1 on error. */
+int sweep_parse(const char *spec, sweep_t *sweep)
+{
+  int i, y, cb, cr, count;
+  int low[3], high[3];
+  const char *p = spec;
+
+  sweep->settings = NULL;
+  sweep->count = 0;
+
+  while (1) {
+    for (i = 0; i < 3; i++) {
+      if (parse_range(&p, &low[i], &high[i]) == -1 ||
+          (i < 2 && *p++ != ',')) {
+        error(0, 0, "%s.%d: Invalid quantization sweep: %s",
+          __FILE__, __LINE__, spec);
+        sweep_free(sweep);
+        return -1;
+      }
+    }
+
+    count = (high[0] - low[0] + 1) * (high[1] - low[1] + 1) *
+      (high[2] - low[2] + 1);
+    if (sweep->count + count > SWEEP_MAX_SETTINGS) {
+      error(0, 0, "%s.%d: More than %d quantization settings: %s",
+        __FILE__, __LINE__, SWEEP_MAX_SETTINGS, spec);
+      sweep_free(sweep);
+      return -1;
+    }
+
+    sweep->settings = realloc(sweep->settings,
+      sizeof(int [3]) * (sweep->count + count));
+    if (sweep->settings == NULL)
+      error(1, 0, "%s.%d: realloc() failed.", __FILE__, __LINE__);
+
+    for (y = low[0]; y <= high[0]; y++)
+      for (cb = low[1]; cb <= high[1]; cb++)
+        for (cr = low[2]; cr <= high[2]; cr++) {
+          sweep->settings[sweep->count][0] = y;
+          sweep->settings[sweep->count][1] = cb;
+          sweep->settings[sweep->count][2] = cr;
+          sweep->count++;
+        }
+
+    if (*p == '\0')
+      break;
+    if (*p++ != ':') {
+      error(0, 0, "%s.%d: Invalid quantization sweep: %s",
+        __FILE__, __LINE__, spec);
+      sweep_free(sweep);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+void sweep_free(sweep_t *sweep)
+{
+  free(sweep->settings);
+  sweep->settings = NULL;
+  sweep->count = 0;
+}
+
+
+
+/* Render one setting to a file named like "base.q4-2-2.ppm". */
+/* Returns 0 on success, or -1 on error. */
+static int render_setting(sweep_job_t *job, jpeg_t *jpeg, int setting)
+{
+  int i, j, result = 0;
+  const int *quant = job->sweep->settings[setting];
+  const convert_options_t *options = job->options;
+  int color = (options->output_type == OUTPUT_COLOR);
+  char name[PATH_MAX];
+  int tables[3][64];
+  FILE *output_file;
+  stats_t stats;
+  pnm_t pnm;
+
+  snprintf(name, sizeof(name), "%s.q%d-%d-%d", job->base, quant[0],
+    quant[1], quant[2]);
+  output_file = convert_open_file(name, (color) ? "ppm" : "pgm");
+  if (output_file == NULL)
+    return -1;
+
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 64; j++)
+      tables[i][j] = quant[i];
+  jpeg_set_quantization(jpeg, tables);
+
+  stats_init(&stats);
+  jpeg->stats = (stats_enabled()) ? &stats : NULL;
+
+  pnm_init(&pnm, output_file, 0, color, options->scale, options->ascii);
+  pnm.stats = jpeg->stats;
+  pnm_set_filter(&pnm, options->despeckle, options->sharpen);
+  jpeg_render_blocks(jpeg, job->blocks,
+    (color) ? pnm_block_to_ppm : pnm_component_to_pgm, &pnm);
+  if (pnm_finish(&pnm) == -1)
+    result = -1;
+  fclose(output_file);
+
+  if (result == 0)
+    stats_report(&stats, name);
+  return result;
+}
+
+
+
+static void *sweep_worker(void *arg)
+{
+  sweep_job_t *job = arg;
+  int i;
+  jpeg_t jpeg;
+
+  /* Note: The quantization is replaced for each setting. */
+  jpeg_init(&jpeg, 1, 1, 1, job->options->idct);
+  jpeg_set_scale(&jpeg, job->options->scale);
+
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    if (i >= job->sweep->count)
+      break;
+
+    if (render_setting(job, &jpeg, i) == -1) {
+      pthread_mutex_lock(&job->lock);
+      job->failed++;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  jpeg_free(&jpeg);
+  return NULL;
+}
+
+
+
+/* Render color or greyscale output of a picture for each setting, using a
+   number of threads, or one for each online CPU if threads is 0. The
+   entropy decoding is reported as stats for base, and each output as
+   stats for its own name. Returns 0 on success, or -1 on error. */
+int sweep_picture(const unsigned char *picture_data, size_t size,
+  const convert_options_t *options, const char *base, const sweep_t *sweep,
+  int threads)
+{
+  int i, result;
+  pthread_t *workers;
+  sweep_job_t job;
+  jpeg_blocks_t blocks;
+  jpeg_t jpeg;
+  stats_t stats;
+
+  if (size < 6) {
+    error(0, 0, "%s.%d: Picture data too small: %zu",
+      __FILE__, __LINE__, size);
+    return -1;
+  }
+
+  /* Note: Skip the 6 byte fake header, as in convert_picture(). */
+  stats_init(&stats);
+  stats.bytes = size;
+  jpeg_init(&jpeg, 1, 1, 1, options->idct);
+  jpeg.stats = (stats_enabled()) ? &stats : NULL;
+  result = jpeg_decode_blocks(&jpeg, picture_data + 6, size - 6, &blocks);
+  jpeg_free(&jpeg);
+  if (result == -1) {
+    jpeg_blocks_free(&blocks);
+    return -1;
+  }
+  stats_report(&stats, base);
+
+  job.sweep = sweep;
+  job.blocks = &blocks;
+  job.options = options;
+  job.base = base;
+  job.next = 0;
+  job.failed = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > sweep->count)
+    threads = sweep->count;
+  if (threads < 1)
+    threads = 1;
+
+  workers = malloc(sizeof(pthread_t) * threads);
+  if (workers == NULL)
+    error(1, 0, "%s.%d: malloc() failed.", __FILE__, __LINE__);
+
+  for (i = 0; i < threads; i++) {
+    result = pthread_create(&workers[i], NULL, sweep_worker, &job);
+    if (result != 0)
+      error(1, result, "%s.%d: pthread_create()", __FILE__, __LINE__);
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+
+  printf("Rendered %d of %d quantization settings using %d threads.\n",
+    sweep->count - job.failed, sweep->count, threads);
+
+  free(workers);
+  pthread_mutex_destroy(&job.lock);
+  jpeg_blocks_free(&blocks);
+
+  return (job.failed > 0) ? -1 : 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _SWEEP_H
+#define _SWEEP_H
+
+#include "convert.h"
+#include <stdlib.h> /* size_t */
+
+/* Quantization settings to render a picture with, see sweep_parse(). */
+typedef struct sweep_s {
+  int (*settings)[3]; /* Luminance, Cb and Cr quantization values. */
+  int count;
+} sweep_t;
+
+int sweep_parse(const char *spec, sweep_t *sweep);
+void sweep_free(sweep_t *sweep);
+int sweep_picture(const unsigned char *picture_data, size_t size,
+  const convert_options_t *options, const char *base, const sweep_t *sweep,
+  int threads);
+
+#endif /* _SWEEP_H */